@@ -0,0 +1,180 @@
+#include "ofApp.h"
+
+static ofxDukKey keyX("x"), keyY("y"), keyZ("z");
+
+static double addTyped(double a, double b) {
+    return a + b;
+}
+
+static int addC(ofxDuktape *duk, void* data) {
+    duk->pushNumber(duk->requireNumber(0) + duk->requireNumber(1));
+    return 1;
+}
+
+// runs a global script function taking no arguments and returns the milliseconds it took
+static double timeGlobal(ofxDuktape& duk, const string& name) {
+    duk.getGlobalString(name);
+    uint64_t start = ofGetElapsedTimeMicros();
+    if (duk.pCall(0) != DUK_EXEC_SUCCESS) {
+        ofLogError("bench") << name << ": " << duk.safeToString(-1);
+    }
+    double millis = (ofGetElapsedTimeMicros() - start) / 1000.0;
+    duk.pop();
+    return millis;
+}
+
+//--------------------------------------------------------------
+void ofApp::setup(){
+    runAll();
+}
+
+//--------------------------------------------------------------
+void ofApp::runAll(){
+    results.clear();
+    benchAllocator();
+    benchDispatch();
+    benchSafeCall();
+    benchKeys();
+    benchBudget();
+}
+
+//--------------------------------------------------------------
+void ofApp::report(const string& name, double millis, double iterations){
+    string line = name + ": " + ofToString(millis, 1) + " ms (" + ofToString(iterations / millis / 1000.0, 2) + " M/s)";
+    ofLogNotice("bench") << line;
+    results.push_back(line);
+}
+
+//--------------------------------------------------------------
+void ofApp::benchAllocator(){
+    const int objects = 2000000, strings = 1000000;
+    ofxDuktape::AllocatorMode modes[] = { ofxDuktape::ALLOCATOR_MALLOC, ofxDuktape::ALLOCATOR_POOL };
+    const char* names[] = { "malloc", "pool" };
+    for (int i = 0; i < 2; i++) {
+        ofxDuktape duk(modes[i]);
+        duk.pEvalString("function objects() { var keep = []; for (var i = 0; i < " + ofToString(objects) + "; i++) {"
+                        " keep[i & 1023] = {x: i, y: i, z: [i]}; } }"
+                        "function strings() { var keep = []; for (var i = 0; i < " + ofToString(strings) + "; i++) {"
+                        " keep[i & 1023] = 'key' + i + '_' + (i * 7); } }");
+        duk.pop();
+        report(string("object churn, ") + names[i], timeGlobal(duk, "objects"), objects);
+        report(string("string churn, ") + names[i], timeGlobal(duk, "strings"), strings);
+        string peak = string("peak heap bytes, ") + names[i] + ": " + ofToString(duk.getHeapStats().peakBytes);
+        ofLogNotice("bench") << peak;
+        results.push_back(peak);
+    }
+}
+
+//--------------------------------------------------------------
+void ofApp::benchDispatch(){
+    const int calls = 2000000;
+    ofxDuktape duk;
+    duk.pEvalString("function script(a, b) { return a + b; }");
+    duk.pop();
+    duk.pushCFunction(&addC, 2, NULL);
+    duk.putGlobalString("c");
+    duk.pushFunction([](ofxDuktape& duk) {
+        duk.pushNumber(duk.requireNumber(0) + duk.requireNumber(1));
+        return 1;
+    }, 2);
+    duk.putGlobalString("cpp");
+    duk.pushFunction(&addTyped);
+    duk.putGlobalString("typed");
+    const char* targets[] = { "script", "c", "cpp", "typed" };
+    for (const char* target : targets) {
+        duk.pEvalString("function calls() { var s = 0; for (var i = 0; i < " + ofToString(calls) + "; i++) {"
+                        " s = " + target + "(s, 1); } return s; }");
+        duk.pop();
+        report(string("calls into ") + target, timeGlobal(duk, "calls"), calls);
+    }
+}
+
+//--------------------------------------------------------------
+void ofApp::benchSafeCall(){
+    const int calls = 2000000;
+    ofxDuktape duk;
+    double sum = 0;
+    uint64_t start = ofGetElapsedTimeMicros();
+    for (int i = 0; i < calls; i++) {
+        duk.safeCall([&sum](ofxDuktape& duk) {
+            sum += 1;
+            return 0;
+        }, 0, 1);
+        duk.pop();
+    }
+    report("safeCall", (ofGetElapsedTimeMicros() - start) / 1000.0, calls);
+    // the same work as a pCall into a function pushed once, for comparison
+    duk.pushFunction([&sum](ofxDuktape& duk) {
+        sum += 1;
+        return 0;
+    }, 0);
+    start = ofGetElapsedTimeMicros();
+    for (int i = 0; i < calls; i++) {
+        duk.dup(-1);
+        duk.pCall(0);
+        duk.pop();
+    }
+    report("pCall into a pushed function", (ofGetElapsedTimeMicros() - start) / 1000.0, calls);
+    duk.pop();
+    ofLogVerbose("bench") << "safeCall sum " << sum;
+}
+
+//--------------------------------------------------------------
+void ofApp::benchKeys(){
+    const int trips = 1000000;
+    ofxDuktape duk;
+    for (int pass = 0; pass < 2; pass++) {
+        bool keys = pass == 1;
+        double sum = 0;
+        uint64_t start = ofGetElapsedTimeMicros();
+        for (int i = 0; i < trips; i++) {
+            // ofVec3f to an object and back, the way the OF bindings convert it
+            duk_idx_t obj = duk.pushObject();
+            if (keys) {
+                duk.putObjectNumber(obj, keyX, i);
+                duk.putObjectNumber(obj, keyY, i);
+                duk.putObjectNumber(obj, keyZ, i);
+                sum += duk.getObjectNumber(obj, keyX) + duk.getObjectNumber(obj, keyY) + duk.getObjectNumber(obj, keyZ);
+            } else {
+                duk.putObjectNumber(obj, "x", i);
+                duk.putObjectNumber(obj, "y", i);
+                duk.putObjectNumber(obj, "z", i);
+                sum += duk.getObjectNumber(obj, "x") + duk.getObjectNumber(obj, "y") + duk.getObjectNumber(obj, "z");
+            }
+            // the getters leave the values they read on the stack
+            duk.setTop(obj);
+        }
+        report(keys ? "vec3 round trips, ofxDukKey" : "vec3 round trips, string keys",
+               (ofGetElapsedTimeMicros() - start) / 1000.0, trips);
+        ofLogVerbose("bench") << "round trip sum " << sum;
+    }
+}
+
+//--------------------------------------------------------------
+void ofApp::benchBudget(){
+    const int iterations = 20000000;
+    ofxDuktape duk;
+    duk.pEvalString("function work() { var s = 0; for (var i = 0; i < " + ofToString(iterations) + "; i++) {"
+                    " s = (s + i) % 1000003; } return s; }");
+    duk.pop();
+    report("script loop", timeGlobal(duk, "work"), iterations);
+    // a budget far past the loop's length, so only the checks are measured
+    duk.setExecutionBudget(60 * 1000 * 1000);
+    report("script loop, budgeted", timeGlobal(duk, "work"), iterations);
+    duk.clearExecutionBudget();
+}
+
+//--------------------------------------------------------------
+void ofApp::draw(){
+    ofBackground(0);
+    ofSetColor(255);
+    for (size_t i = 0; i < results.size(); i++) {
+        ofDrawBitmapString(results[i], 20, 30 + 16 * i);
+    }
+    ofDrawBitmapString("press space to run again", 20, 50 + 16 * results.size());
+}
+
+//--------------------------------------------------------------
+void ofApp::keyPressed(int key){
+    if (key == ' ') runAll();
+}
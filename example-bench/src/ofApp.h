@@ -0,0 +1,33 @@
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+// times the addon's hot paths and lists the results, also sent to the log.
+// build it in release mode, the numbers mean little otherwise
+class ofApp : public ofBaseApp{
+
+	public:
+		void setup();
+		void draw();
+
+		void keyPressed(int key);
+
+        // runs every benchmark again
+        void runAll();
+        // allocator modes on object and string churn
+        void benchAllocator();
+        // calls from JS into the different kinds of native functions
+        void benchDispatch();
+        // protected calls through safeCall
+        void benchSafeCall();
+        // ofVec3f-like round trips through string keys and ofxDukKey
+        void benchKeys();
+        // a script loop with and without an execution budget
+        void benchBudget();
+
+        // logs and keeps a line of results
+        void report(const string& name, double millis, double iterations);
+
+        vector<string> results;
+};
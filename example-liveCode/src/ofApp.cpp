@@ -1,6 +1,9 @@
 #include "ofApp.h"
 #include "ofxDukOFBindings.h"
 
+// keeps a runaway script (say, while(true){}) from freezing the app
+static const uint64_t scriptBudgetMicros = 2000000;
+
 //--------------------------------------------------------------
 void ofApp::setup(){
     ofBackground(0);
@@ -29,14 +32,14 @@ void ofApp::executeScriptEvent(int& whichEditor) {
     if (retcode != 0) {
         editor.evalReplReturn(string("error: ") + duk.safeToString(-1));
     } else {
-        int call_retcode = duk.pCall(0);
+        int call_retcode = duk.pCallBudgeted(0, scriptBudgetMicros);
         
         editor.evalReplReturn(duk.safeToString(-1));
     }
 }
 
 void ofApp::evalReplEvent(const string& text) {
-    int retcode = duk.pEvalString(text);
+    int retcode = duk.pEvalStringBudgeted(text, scriptBudgetMicros);
     string ret = duk.safeToString(-1);
     if (retcode != 0) {
         editor.evalReplReturn(ret);
@@ -3097,6 +3097,23 @@ typedef struct duk_hthread duk_context;
 
 /* __OVERRIDE_DEFINES__ */
 
+/* ofxDuktape: execution budgets, see ofxDuktape::setExecutionBudget().
+ * The udata is the heap_udata given to duk_create_heap (the owning ofxDuktape).
+ */
+#define DUK_USE_INTERRUPT_COUNTER
+#if defined(__cplusplus)
+extern "C"
+#endif
+duk_bool_t ofxDuktapeExecTimeoutCheck(void *udata);
+#define DUK_USE_EXEC_TIMEOUT_CHECK(udata) ofxDuktapeExecTimeoutCheck((udata))
+
+/* ofxDuktape: with OFXDUKTAPE_FRAME_GC defined, voluntary collections are
+ * left to the host, which runs them between frames (see ofxDuktapeFrameGC).
+ */
+#if defined(OFXDUKTAPE_FRAME_GC)
+#undef DUK_USE_VOLUNTARY_GC
+#endif
+
 /*
  *  Conditional includes
  */
@@ -8,6 +8,13 @@
 
 #include "ofxDukOFBindings.h"
 
+// keys used by the converters below, interned once per heap
+static const ofxDukKey keyX("x"), keyY("y"), keyZ("z");
+static const ofxDukKey keyR("r"), keyG("g"), keyB("b"), keyA("a");
+static const ofxDukKey keyWidth("width"), keyHeight("height");
+static const ofxDukKey keyType("type"), keyButton("button"), keyScrollX("scrollX"), keyScrollY("scrollY");
+static const ofxDukKey keyKey("key"), keyKeycode("keycode"), keyScancode("scancode"), keyCodepoint("codepoint");
+
 static ofColor ofColorFromObject(ofxDuktape& duk, duk_idx_t index) {
     if (duk.isNumber(index)) {
         return ofColor(duk.getNumber(index));
@@ -30,70 +37,78 @@ static ofColor ofColorFromObject(ofxDuktape& duk, duk_idx_t index) {
             return ofColor(duk.getObjectNumber(index, 0));
         }
     }
-    if (duk.hasProperties(index, {"r", "g", "b"}))
+    if (duk.hasProperty(index, keyR) && duk.hasProperty(index, keyG) && duk.hasProperty(index, keyB))
     {
-        if (duk.hasProperty(index, "a")) {
-            return ofColor(duk.getObjectNumber(index, "r"),
-                           duk.getObjectNumber(index, "g"),
-                           duk.getObjectNumber(index, "b"),
-                           duk.getObjectNumber(index, "a"));
+        if (duk.hasProperty(index, keyA)) {
+            return ofColor(duk.getObjectNumber(index, keyR),
+                           duk.getObjectNumber(index, keyG),
+                           duk.getObjectNumber(index, keyB),
+                           duk.getObjectNumber(index, keyA));
         } else {
-            return ofColor(duk.getObjectNumber(index, "r"),
-                           duk.getObjectNumber(index, "g"),
-                           duk.getObjectNumber(index, "b"));
+            return ofColor(duk.getObjectNumber(index, keyR),
+                           duk.getObjectNumber(index, keyG),
+                           duk.getObjectNumber(index, keyB));
         }
     }
     return ofColor();
 }
 static ofRectangle ofRectangleFromObject(ofxDuktape& duk, duk_idx_t index) {
     return ofRectangle(
-                       duk.getObjectNumber(index, "x"),
-                       duk.getObjectNumber(index, "y"),
-                       duk.getObjectNumber(index, "width"),
-                       duk.getObjectNumber(index, "height"));
+                       duk.getObjectNumber(index, keyX),
+                       duk.getObjectNumber(index, keyY),
+                       duk.getObjectNumber(index, keyWidth),
+                       duk.getObjectNumber(index, keyHeight));
 }
 static duk_idx_t objectFromofColor(ofxDuktape& duk, const ofColor& c) {
     duk_idx_t obj = duk.pushObject();
-    duk.putObjectInts(obj, {
-        {"r", c.r},
-        {"g", c.g},
-        {"b", c.b},
-        {"a", c.a}
-    });
+    duk.putObjectInt(obj, keyR, c.r);
+    duk.putObjectInt(obj, keyG, c.g);
+    duk.putObjectInt(obj, keyB, c.b);
+    duk.putObjectInt(obj, keyA, c.a);
     return obj;
 }
 static duk_idx_t objectFromofRectangle(ofxDuktape& duk, const ofRectangle& c) {
     duk_idx_t obj = duk.pushObject();
-    duk.putObjectNumbers(obj, {
-        {"x", c.x},
-        {"y", c.y},
-        {"width", c.width},
-        {"height", c.height}
-    });
+    duk.putObjectNumber(obj, keyX, c.x);
+    duk.putObjectNumber(obj, keyY, c.y);
+    duk.putObjectNumber(obj, keyWidth, c.width);
+    duk.putObjectNumber(obj, keyHeight, c.height);
     return obj;
 }
 
 static duk_idx_t objectFromofVec2f(ofxDuktape& duk, ofVec2f v) {
     duk_idx_t obj = duk.pushObject();
-    duk.putObjectNumbers(obj, { {"x", v.x}, {"y", v.y} });
+    duk.putObjectNumber(obj, keyX, v.x);
+    duk.putObjectNumber(obj, keyY, v.y);
     return obj;
 }
 
 static ofVec2f ofVec2fFromObject(ofxDuktape& duk, duk_idx_t i) {
-    return ofVec2f(duk.getObjectNumber(i, "x"), duk.getObjectNumber(i, "y"));
+    return ofVec2f(duk.getObjectNumber(i, keyX), duk.getObjectNumber(i, keyY));
 }
 
 static duk_idx_t objectFromofVec3f(ofxDuktape& duk, ofVec3f v) {
     duk_idx_t obj = duk.pushObject();
-    duk.putObjectNumbers(obj, { {"x", v.x}, {"y", v.y}, {"z", v.z} });
+    duk.putObjectNumber(obj, keyX, v.x);
+    duk.putObjectNumber(obj, keyY, v.y);
+    duk.putObjectNumber(obj, keyZ, v.z);
     return obj;
 }
 
 static ofVec3f ofVec3fFromObject(ofxDuktape& duk, duk_idx_t i) {
-    return ofVec3f(duk.getObjectNumber(i, "x"), duk.getObjectNumber(i, "y"), duk.getObjectNumber(i, "z"));
+    return ofVec3f(duk.getObjectNumber(i, keyX), duk.getObjectNumber(i, keyY), duk.getObjectNumber(i, keyZ));
 }
 
-ofxDukBindings::ofxDukBindings(ofxDuktape& duk): duk(duk) {
+ofxDukBindings::ofxDukBindings(ofxDuktape& duk): duk(duk), promises(duk), frameGC(duk), pipelinePool(NULL), pipelineBusy(false), inputBatching(false), keysDown(0), buttonsDown(0), dispatching(0), listenersDirty(false), dragPool(NULL), dragLoads(0), alive(make_shared<bool>(true)) {
+    std::fill(callable, callable + EVENT_COUNT, false);
+    memset(&state, 0, sizeof(state));
+    memset(&staging, 0, sizeof(staging));
+    {
+        lock_guard<mutex> guard(instancesLock);
+        getInstances().push_back(this);
+    }
+    ofAddListener(duk.onDestroy, this, &ofxDukBindings::onDestroy);
+    ofAddListener(ofEvents().update, this, &ofxDukBindings::onFrameStart, OF_EVENT_ORDER_BEFORE_APP);
     ofAddListener(ofEvents().update, this, &ofxDukBindings::onUpdate);
     ofAddListener(ofEvents().draw, this, &ofxDukBindings::onDraw);
     
@@ -113,6 +128,17 @@ ofxDukBindings::ofxDukBindings(ofxDuktape& duk): duk(duk) {
 }
 
 ofxDukBindings::~ofxDukBindings() {
+    waitPipeline();
+    waitDragLoads();
+    // drops drag events posted but not yet run
+    *alive = false;
+    {
+        lock_guard<mutex> guard(instancesLock);
+        vector<ofxDukBindings*>& instances = getInstances();
+        instances.erase(std::remove(instances.begin(), instances.end(), this), instances.end());
+    }
+    ofRemoveListener(duk.onDestroy, this, &ofxDukBindings::onDestroy);
+    ofRemoveListener(ofEvents().update, this, &ofxDukBindings::onFrameStart, OF_EVENT_ORDER_BEFORE_APP);
     ofRemoveListener(ofEvents().update, this, &ofxDukBindings::onUpdate);
     ofRemoveListener(ofEvents().draw, this, &ofxDukBindings::onDraw);
     
@@ -131,186 +157,645 @@ ofxDukBindings::~ofxDukBindings() {
     ofRemoveListener(ofEvents().messageEvent, this, &ofxDukBindings::onMessageEvent);
 }
 
+void ofxDukBindings::onDestroy(ofxDuktape::DestroyEvent &ev) {
+    delete this;
+}
+
 void ofxDukBindings::onDraw(ofEventArgs &ev) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    if (duk.getProperty(of_events, "draw")) {
-        if (duk.isCallable(-1)) {
-            duk.call(-1);
-        }
+    if (pipelinePool) {
+        // the update started last frame produced this frame's scene
+        waitPipeline();
+        std::swap(scene, nextScene);
+        startPipeline();
+        drawScene();
+        return;
     }
-    duk.setTop(top);
+    if (hasListeners(EVENT_DRAW)) dispatch(EVENT_DRAW, 0);
+    frameGC.endFrame();
+}
+
+void ofxDukBindings::onFrameStart(ofEventArgs &ev) {
+    captureState();
+    // pipelined heaps start and end their frames on the pool
+    if (!pipelinePool) frameGC.beginFrame();
 }
 
 void ofxDukBindings::onUpdate(ofEventArgs &ev) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    if (duk.getProperty(of_events, "update")) {
-        if (duk.isCallable(-1)) {
-            duk.call(0);
+    if (!parallelPool && !pipelinePool) update();
+}
+
+void ofxDukBindings::update(string* scene) {
+    // calls posted from other threads land before the script's update,
+    // and whatever they settle gets its promise reactions run below
+    duk.runPosted();
+    publishState();
+    deliverInput();
+    if (hasListeners(EVENT_UPDATE)) {
+        dispatch(EVENT_UPDATE, 0, scene);
+    } else if (scene) {
+        scene->clear();
+    }
+    promises.drain();
+    // with the frame deferring, this only collects past the deferral cap
+    duk.collectIfDue();
+}
+
+void ofxDukBindings::setPipelined(ofxDuktapeWorkerPool* pool, ofxDuktape* drawHeap, duk_idx_t drawIndex) {
+    if (pool) {
+        // the heap runs on the pool while the main thread keeps serving
+        // everything else, so nothing else may share it
+        ofxDuktape* owner = duk.getHeapOwner();
+        if (drawHeap && drawHeap->getHeapOwner() == owner) {
+            ofLogError("ofxDukBindings") << "setPipelined: the draw heap can't be the pipelined heap";
+            return;
+        }
+        lock_guard<mutex> guard(instancesLock);
+        for (ofxDukBindings* bindings: getInstances()) {
+            if (bindings != this && bindings->duk.getHeapOwner() == owner) {
+                ofLogError("ofxDukBindings") << "setPipelined: other bindings share this heap";
+                return;
+            }
         }
     }
-    duk.setTop(top);
+    waitPipeline();
+    pipelinePool = pool;
+    scene.clear();
+    nextScene.clear();
+    if (pool && drawHeap) {
+        drawFunction.reset(*drawHeap, drawIndex);
+    } else {
+        drawFunction.reset();
+    }
 }
 
-void ofxDukBindings::onKeyEvent(ofKeyEventArgs &ev) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    const char* type = "keyPressed";
-    switch(ev.type) {
-        case ofKeyEventArgs::Pressed:
-            type = "keyPressed";
-            break;
-        case ofKeyEventArgs::Released:
-            type = "keyReleased";
-            break;
-    }
-    if (duk.getProperty(-1, type)) {
-        if (duk.isCallable(-1)) {
-            auto ev_args = duk.pushObject();
-            duk.putObjectInt(ev_args, "key", ev.key);
-            duk.putObjectInt(ev_args, "keycode", ev.keycode);
-            duk.putObjectInt(ev_args, "scancode", ev.scancode);
-            duk.putObjectUint(ev_args, "codepoint", ev.codepoint);
-            duk.putObjectString(ev_args, "type", type);
-            duk.call(1);
+void ofxDukBindings::startPipeline() {
+    {
+        lock_guard<mutex> guard(pipelineLock);
+        pipelineBusy = true;
+    }
+    pipelinePool->submit([this] {
+        frameGC.beginFrame();
+        update(&nextScene);
+        frameGC.endFrame();
+        lock_guard<mutex> guard(pipelineLock);
+        pipelineBusy = false;
+        pipelineIdle.notify_all();
+    });
+}
+
+void ofxDukBindings::waitPipeline() {
+    unique_lock<mutex> guard(pipelineLock);
+    pipelineIdle.wait(guard, [this] { return !pipelineBusy; });
+}
+
+void ofxDukBindings::drawScene() {
+    if (!drawFunction) return;
+    ofxDuktape& draw = *drawFunction.getDuktape();
+    auto top = draw.getTop();
+    drawFunction.push();
+    if (scene.empty()) {
+        draw.pushUndefined();
+    } else {
+        draw.cborDecode(scene);
+    }
+    if (draw.pCall(1) != 0) {
+        ofLogError("ofxDukBindings") << "draw: " << draw.safeToString(-1);
+    }
+    draw.setTop(top);
+}
+
+ofxDuktapeWorkerPool* ofxDukBindings::parallelPool = NULL;
+mutex ofxDukBindings::instancesLock;
+
+vector<ofxDukBindings*>& ofxDukBindings::getInstances() {
+    static vector<ofxDukBindings*> instances;
+    return instances;
+}
+
+void ofxDukBindings::setParallelUpdate(ofxDuktapeWorkerPool* pool) {
+    if (pool && !parallelPool) {
+        ofAddListener(ofEvents().update, &ofxDukBindings::onParallelUpdate);
+    } else if (!pool && parallelPool) {
+        ofRemoveListener(ofEvents().update, &ofxDukBindings::onParallelUpdate);
+    }
+    parallelPool = pool;
+}
+
+void ofxDukBindings::onParallelUpdate(ofEventArgs &ev) {
+    // one job per heap, keeping the order bindings were set up in
+    map<ofxDuktape*, size_t> heapJobs;
+    vector<vector<pair<ofxDukBindings*, shared_ptr<bool>>>> groups;
+    {
+        lock_guard<mutex> guard(instancesLock);
+        for (ofxDukBindings* bindings: getInstances()) {
+            if (bindings->pipelinePool) continue;
+            auto found = heapJobs.emplace(bindings->duk.getHeapOwner(), groups.size());
+            if (found.second) groups.emplace_back();
+            groups[found.first->second].emplace_back(bindings, bindings->alive);
         }
     }
-    duk.setTop(top);
+    vector<function<void()>> jobs;
+    for (auto& group: groups) {
+        jobs.push_back([&group] {
+            // an update can collect the thread of bindings later in the group
+            for (auto& bindings: group) {
+                if (*bindings.second) bindings.first->update();
+            }
+        });
+    }
+    // the barrier: draw only starts once every heap is done
+    parallelPool->run(jobs);
+}
+
+void ofxDukBindings::onKeyEvent(ofKeyEventArgs &ev) {
+    trackKey(ev);
+    if (inputBatching) {
+        queueInput(ev.type == ofKeyEventArgs::Released ? EVENT_KEY_RELEASED : EVENT_KEY_PRESSED,
+                   ev.key, ev.keycode, ev.scancode, ev.codepoint, 0);
+        return;
+    }
+    if (pipelinePool) {
+        // the heap may be busy on the pool, so this waits for its next update
+        duk.post([this, ev](ofxDuktape&) { keyEvent(ev); });
+        return;
+    }
+    keyEvent(ev);
+}
+
+void ofxDukBindings::keyEvent(const ofKeyEventArgs &ev) {
+    EventSlot slot = ev.type == ofKeyEventArgs::Released ? EVENT_KEY_RELEASED : EVENT_KEY_PRESSED;
+    if (!hasListeners(slot)) return;
+    auto ev_args = duk.pushObject();
+    duk.putObjectInt(ev_args, keyKey, ev.key);
+    duk.putObjectInt(ev_args, keyKeycode, ev.keycode);
+    duk.putObjectInt(ev_args, keyScancode, ev.scancode);
+    duk.putObjectUint(ev_args, keyCodepoint, ev.codepoint);
+    duk.putObjectString(ev_args, keyType, eventNames[slot]);
+    dispatch(slot, 1);
 }
 
 void ofxDukBindings::onMouseEvent(ofMouseEventArgs &ev) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    const char* type = "mouseMoved";
+    trackMouse(ev);
+    if (inputBatching) {
+        queueInput(mouseSlot(ev), ev.x, ev.y, ev.button, ev.scrollX, ev.scrollY);
+        return;
+    }
+    if (pipelinePool) {
+        // the heap may be busy on the pool, so this waits for its next update
+        duk.post([this, ev](ofxDuktape&) { mouseEvent(ev); });
+        return;
+    }
+    mouseEvent(ev);
+}
+
+ofxDukBindings::EventSlot ofxDukBindings::mouseSlot(const ofMouseEventArgs &ev) {
     switch(ev.type) {
-        case ofMouseEventArgs::Moved:
-            type = "mouseMoved";
-            break;
         case ofMouseEventArgs::Pressed:
-            type = "mousePressed";
-            break;
+            return EVENT_MOUSE_PRESSED;
         case ofMouseEventArgs::Released:
-            type = "mouseReleased";
-            break;
+            return EVENT_MOUSE_RELEASED;
         case ofMouseEventArgs::Entered:
-            type = "mouseEntered";
-            break;
+            return EVENT_MOUSE_ENTERED;
         case ofMouseEventArgs::Exited:
-            type = "mouseExited";
-            break;
+            return EVENT_MOUSE_EXITED;
         case ofMouseEventArgs::Dragged:
-            type = "mouseDragged";
-            break;
+            return EVENT_MOUSE_DRAGGED;
         case ofMouseEventArgs::Scrolled:
-            type = "mouseScrolled";
-            break;
-    }
-    if (duk.getProperty(-1, type)) {
-        if (duk.isCallable(-1)) {
-            auto ev_args = duk.pushObject();
-            duk.putObjectInt(ev_args, "button", ev.button);
-            duk.putObjectNumber(ev_args, "scrollX", ev.scrollX);
-            duk.putObjectNumber(ev_args, "scrollY", ev.scrollY);
-            duk.putObjectNumber(ev_args, "x", ev.x);
-            duk.putObjectNumber(ev_args, "y", ev.y);
-            duk.putObjectString(ev_args, "type", type);
-            duk.call(1);
-        }
+            return EVENT_MOUSE_SCROLLED;
+        default:
+            return EVENT_MOUSE_MOVED;
     }
-    duk.setTop(top);
+}
+
+void ofxDukBindings::mouseEvent(const ofMouseEventArgs &ev) {
+    EventSlot slot = mouseSlot(ev);
+    if (!hasListeners(slot)) return;
+    auto ev_args = duk.pushObject();
+    duk.putObjectInt(ev_args, keyButton, ev.button);
+    duk.putObjectNumber(ev_args, keyScrollX, ev.scrollX);
+    duk.putObjectNumber(ev_args, keyScrollY, ev.scrollY);
+    duk.putObjectNumber(ev_args, keyX, ev.x);
+    duk.putObjectNumber(ev_args, keyY, ev.y);
+    duk.putObjectString(ev_args, keyType, eventNames[slot]);
+    dispatch(slot, 1);
 }
 
 void ofxDukBindings::onWindowResizeEvent(ofResizeEventArgs& ev) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    if (duk.getProperty(of_events, "windowResized")) {
-        if (duk.isCallable(-1)) {
-            duk.pushInt(ev.width);
-            duk.pushInt(ev.height);
-            duk.call(2);
-        }
+    if (pipelinePool) {
+        // the heap may be busy on the pool, so this waits for its next update
+        duk.post([this, ev](ofxDuktape&) { windowResizeEvent(ev); });
+        return;
     }
-    duk.setTop(top);
+    windowResizeEvent(ev);
+}
+
+void ofxDukBindings::windowResizeEvent(const ofResizeEventArgs& ev) {
+    if (!hasListeners(EVENT_WINDOW_RESIZED)) return;
+    duk.pushInt(ev.width);
+    duk.pushInt(ev.height);
+    dispatch(EVENT_WINDOW_RESIZED, 2);
 }
 
 void ofxDukBindings::onDragEvent(ofDragInfo& dragInfo) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    if (duk.getProperty(of_events, "dragEvent")) {
-        if (duk.isCallable(-1)) {
-            auto ev_args = duk.pushObject();
-            auto files_arr = duk.pushArray();
-            int counter = 0;
-            for (auto file: dragInfo.files) {
-                duk.putObjectString(files_arr, counter, file);
-                counter++;
+    if (dragPool) {
+        loadDropped(dragInfo);
+        return;
+    }
+    if (pipelinePool) {
+        // the heap may be busy on the pool, so this waits for its next update
+        duk.post([this, dragInfo](ofxDuktape&) { dragEvent(dragInfo); });
+        return;
+    }
+    dragEvent(dragInfo);
+}
+
+// reads a whole file into memory a heap can adopt; invalid if it can't be read
+static ofxDukTransfer ofxDukBindingsReadFile(const string& path) {
+    ifstream file(path, ios::binary | ios::ate);
+    if (!file) return ofxDukTransfer();
+    streamoff size = file.tellg();
+    if (size < 0) return ofxDukTransfer();
+    ofxDukTransfer buffer((size_t)size);
+    file.seekg(0);
+    if (!buffer || !file.read((char*)buffer.getData(), size)) return ofxDukTransfer();
+    return buffer;
+}
+
+void ofxDukBindings::setDragLoading(ofxDuktapeWorkerPool* pool) {
+    if (!pool) waitDragLoads();
+    dragPool = pool;
+}
+
+void ofxDukBindings::waitDragLoads() {
+    unique_lock<mutex> guard(dragLock);
+    dragIdle.wait(guard, [this] { return dragLoads == 0; });
+}
+
+void ofxDukBindings::loadDropped(const ofDragInfo& dragInfo) {
+    {
+        lock_guard<mutex> guard(dragLock);
+        dragLoads++;
+    }
+    dragPool->submit([this, dragInfo] {
+        // shared, since posted calls have to be copyable
+        auto buffers = make_shared<vector<ofxDukTransfer>>();
+        for (const string& path: dragInfo.files) {
+            buffers->push_back(ofxDukBindingsReadFile(path));
+            if (!buffers->back()) {
+                ofLogError("ofxDukBindings") << "couldn't read dropped file " << path;
+            }
+        }
+        shared_ptr<bool> alive = this->alive;
+        duk.post([this, alive, dragInfo, buffers](ofxDuktape&) {
+            if (*alive) dragEvent(dragInfo, buffers.get());
+        });
+        lock_guard<mutex> guard(dragLock);
+        dragLoads--;
+        dragIdle.notify_all();
+    });
+}
+
+void ofxDukBindings::dragEvent(const ofDragInfo& dragInfo, vector<ofxDukTransfer>* buffers) {
+    if (!hasListeners(EVENT_DRAG)) return;
+    auto ev_args = duk.pushObject();
+    auto files_arr = duk.pushArray();
+    int counter = 0;
+    for (auto file: dragInfo.files) {
+        duk.putObjectString(files_arr, counter, file);
+        counter++;
+    }
+    duk.putPropString(ev_args, "files");
+    auto position = duk.pushObject();
+    duk.putObjectInt(position, "x", dragInfo.position.x);
+    duk.putObjectInt(position, "y", dragInfo.position.y);
+    duk.putPropString(ev_args, "position");
+    if (buffers) {
+        auto buffers_arr = duk.pushArray();
+        for (size_t i = 0; i < buffers->size(); i++) {
+            if ((*buffers)[i]) {
+                duk.pushTransfer(std::move((*buffers)[i]));
+            } else {
+                duk.pushNull();
             }
-            duk.putPropString(ev_args, "files");
-            auto position = duk.pushObject();
-            duk.putObjectInt(position, "x", dragInfo.position.x);
-            duk.putObjectInt(position, "y", dragInfo.position.y);
-            duk.putPropString(ev_args, "position");
-            duk.call(1);
+            duk.putPropIndex(buffers_arr, i);
         }
+        duk.putPropString(ev_args, "buffers");
     }
-    duk.setTop(top);
+    dispatch(EVENT_DRAG, 1);
 }
 
 void ofxDukBindings::onMessageEvent(ofMessage &message) {
-    auto top = duk.getTop();
-    duk.getGlobalString("of");
-    auto of_events = duk.getObjectObject(-1, "events");
-    if (duk.getProperty(of_events, "gotMessage")) {
-        if (duk.isCallable(-1)) {
-            duk.pushString(message.message);
-            duk.call(1);
+    if (pipelinePool) {
+        // the heap may be busy on the pool, so this waits for its next update
+        duk.post([this, message](ofxDuktape&) { messageEvent(message); });
+        return;
+    }
+    messageEvent(message);
+}
+
+void ofxDukBindings::messageEvent(const ofMessage &message) {
+    if (!hasListeners(EVENT_GOT_MESSAGE)) return;
+    duk.pushString(message.message);
+    dispatch(EVENT_GOT_MESSAGE, 1);
+}
+
+const char* ofxDukBindings::eventNames[EVENT_COUNT] = {
+    "update", "draw",
+    "mouseMoved", "mousePressed", "mouseReleased", "mouseDragged",
+    "mouseEntered", "mouseExited", "mouseScrolled",
+    "keyPressed", "keyReleased",
+    "windowResized", "dragEvent", "gotMessage",
+    "input",
+};
+
+bool ofxDukBindings::slotForName(const char* type, EventSlot& slot) {
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        if (strcmp(type, eventNames[i]) == 0) {
+            slot = (EventSlot)i;
+            return true;
         }
     }
-    duk.setTop(top);
+    return false;
 }
 
-ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
-    auto of = duk.pushObject();
-    
-    void* bindings_store = duk.pushFixedBuffer(sizeof(ofxDukBindings));
-    
-    ofxDukBindings* bindings = new (bindings_store) ofxDukBindings(duk);
-    
-    /*
-    duk.setFinalizerFunction(-1, [bindings](ofxDuktape& duk) {
-        bindings->~ofxDukBindings();
-        return 0;
-    });
-     */
-    duk.putPropString(of, DUK_HIDDEN_SYMBOL("bindings"));
-    
+bool ofxDukBindings::addEventListener(const string& type, duk_idx_t index, int priority) {
+    EventSlot slot;
+    if (!slotForName(type.c_str(), slot)) return false;
+    addEventListener(slot, index, priority);
+    return true;
+}
+
+void ofxDukBindings::addEventListener(EventSlot slot, duk_idx_t index, int priority) {
+    void* fn = duk.getHeapPtr(index);
+    for (const Listener& listener: listeners[slot]) {
+        if (!listener.removed && listener.fn.getHeapPtr() == fn) return;
+    }
+    for (const auto& pending: pendingListeners) {
+        if (pending.first == slot && pending.second.fn.getHeapPtr() == fn) return;
+    }
+    Listener listener;
+    listener.fn.reset(duk, index);
+    listener.priority = priority;
+    listener.removed = false;
+    if (dispatching) {
+        pendingListeners.emplace_back(slot, std::move(listener));
+    } else {
+        insertListener(slot, std::move(listener));
+    }
+}
+
+bool ofxDukBindings::removeEventListener(const string& type, duk_idx_t index) {
+    EventSlot slot;
+    if (!slotForName(type.c_str(), slot)) return false;
+    return removeEventListener(slot, index);
+}
+
+bool ofxDukBindings::removeEventListener(EventSlot slot, duk_idx_t index) {
+    void* fn = duk.getHeapPtr(index);
+    if (!fn) return false;
+    vector<Listener>& list = listeners[slot];
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].removed || list[i].fn.getHeapPtr() != fn) continue;
+        if (dispatching) {
+            list[i].removed = true;
+            listenersDirty = true;
+        } else {
+            list.erase(list.begin() + i);
+        }
+        return true;
+    }
+    for (size_t i = 0; i < pendingListeners.size(); i++) {
+        if (pendingListeners[i].first == slot && pendingListeners[i].second.fn.getHeapPtr() == fn) {
+            pendingListeners.erase(pendingListeners.begin() + i);
+            return true;
+        }
+    }
+    return false;
+}
+
+void ofxDukBindings::insertListener(EventSlot slot, Listener&& listener) {
+    vector<Listener>& list = listeners[slot];
+    auto at = std::upper_bound(list.begin(), list.end(), listener.priority,
+                               [](int priority, const Listener& other) { return priority < other.priority; });
+    list.insert(at, std::move(listener));
+}
+
+void ofxDukBindings::flushListeners() {
+    for (auto& list: listeners) {
+        list.erase(std::remove_if(list.begin(), list.end(), [](const Listener& listener) { return listener.removed; }), list.end());
+    }
+    for (auto& pending: pendingListeners) {
+        insertListener(pending.first, std::move(pending.second));
+    }
+    pendingListeners.clear();
+    listenersDirty = false;
+}
+
+void ofxDukBindings::dispatch(EventSlot slot, int nargs, string* result) {
+    duk_idx_t args = duk.getTop() - nargs;
+    if (result) result->clear();
+    if (callable[slot] && invoke(slot, handlers[slot], args, nargs) && result && !duk.isUndefined(-1)) {
+        // values CBOR can't take (like cyclic objects) throw
+        if (duk.safeCall([result](ofxDuktape& duk) {
+            *result = duk.cborEncode(-1);
+            return 0;
+        }, 1, 1) != DUK_EXEC_SUCCESS) {
+            ofLogError("ofxDukBindings") << eventNames[slot] << ": " << duk.safeToString(-1);
+            result->clear();
+        }
+    }
+    duk.setTop(args + nargs);
+    dispatching++;
+    // listeners added meanwhile wait in pendingListeners, so the size holds
+    vector<Listener>& list = listeners[slot];
+    for (size_t i = 0; i < list.size(); i++) {
+        if (list[i].removed) continue;
+        invoke(slot, list[i].fn, args, nargs);
+        duk.setTop(args + nargs);
+    }
+    if (--dispatching == 0 && (listenersDirty || !pendingListeners.empty())) flushListeners();
+    duk.setTop(args);
+}
+
+bool ofxDukBindings::invoke(EventSlot slot, const ofxDukRef& fn, duk_idx_t args, int nargs) {
+    fn.push(duk);
+    for (int i = 0; i < nargs; i++) {
+        duk.dup(args + i);
+    }
+    if (duk.pCall(nargs) != 0) {
+        ofLogError("ofxDukBindings") << eventNames[slot] << ": " << duk.safeToString(-1);
+        return false;
+    }
+    return true;
+}
+
+void ofxDukBindings::setHandler(ofxDuktape& ctx, EventSlot slot) {
+    callable[slot] = ctx.isCallable(-1);
+    // pinned from the main stack so the ref doesn't outlive the thread the
+    // assignment ran on
+    if (&ctx == &duk) {
+        handlers[slot].reset(duk, -1);
+    } else {
+        duk.xcopyTop(&ctx, 1);
+        handlers[slot].reset(duk, -1);
+        duk.pop();
+    }
+}
+
+void ofxDukBindings::setInputBatching(bool enabled) {
+    lock_guard<mutex> guard(inputLock);
+    inputBatching = enabled;
+    inputQueue.clear();
+}
+
+void ofxDukBindings::queueInput(EventSlot type, double a, double b, double c, double d, double e) {
+    lock_guard<mutex> guard(inputLock);
+    if (!inputQueue.empty()) {
+        double* last = &inputQueue[inputQueue.size() - inputStride];
+        if (last[0] == type) {
+            // only where a move ends up matters
+            if (type == EVENT_MOUSE_MOVED || (type == EVENT_MOUSE_DRAGGED && last[3] == c)) {
+                last[1] = a;
+                last[2] = b;
+                return;
+            }
+            if (type == EVENT_MOUSE_SCROLLED) {
+                last[1] = a;
+                last[2] = b;
+                last[4] += d;
+                last[5] += e;
+                return;
+            }
+        }
+    }
+    double record[inputStride] = {(double)type, a, b, c, d, e};
+    inputQueue.insert(inputQueue.end(), record, record + inputStride);
+}
+
+void ofxDukBindings::deliverInput() {
+    {
+        // input keeps arriving on the main thread while a pool thread delivers
+        lock_guard<mutex> guard(inputLock);
+        if (inputQueue.empty()) return;
+        inputBatch.swap(inputQueue);
+        inputQueue.clear();
+    }
+    if (hasListeners(EVENT_INPUT)) {
+        size_t bytes = inputBatch.size() * sizeof(double);
+        memcpy(duk.pushFixedBuffer(bytes), inputBatch.data(), bytes);
+        duk.pushBufferObject(-1, 0, bytes, DUK_BUFOBJ_FLOAT64ARRAY);
+        duk.remove(-2);
+        dispatch(EVENT_INPUT, 1);
+    }
+    inputBatch.clear();
+}
+
+void ofxDukBindings::trackKey(const ofKeyEventArgs &ev) {
+    lock_guard<mutex> guard(inputLock);
+    if (ev.key < 0 || ev.key >= (int)stateKeys) return;
+    uint8_t down = ev.type == ofKeyEventArgs::Pressed;
+    if (staging.keys[ev.key] != down) {
+        keysDown += down ? 1 : -1;
+        staging.keys[ev.key] = down;
+    }
+}
+
+void ofxDukBindings::trackMouse(const ofMouseEventArgs &ev) {
+    lock_guard<mutex> guard(inputLock);
+    if (ev.type != ofMouseEventArgs::Pressed && ev.type != ofMouseEventArgs::Released) return;
+    if (ev.button < 0 || ev.button >= (int)stateMouseButtons) return;
+    uint8_t down = ev.type == ofMouseEventArgs::Pressed;
+    if (staging.mouseButtons[ev.button] != down) {
+        buttonsDown += down ? 1 : -1;
+        staging.mouseButtons[ev.button] = down;
+    }
+}
+
+void ofxDukBindings::captureState() {
+    lock_guard<mutex> guard(inputLock);
+    double* values = staging.values;
+    values[STATE_MOUSE_X] = ofGetMouseX();
+    values[STATE_MOUSE_Y] = ofGetMouseY();
+    values[STATE_PREVIOUS_MOUSE_X] = ofGetPreviousMouseX();
+    values[STATE_PREVIOUS_MOUSE_Y] = ofGetPreviousMouseY();
+    values[STATE_MOUSE_PRESSED] = buttonsDown > 0;
+    values[STATE_ANY_KEY_PRESSED] = keysDown > 0;
+    // a bit each for shift, control, alt and super
+    values[STATE_MODIFIERS] = (ofGetKeyPressed(OF_KEY_SHIFT) ? 1 : 0) | (ofGetKeyPressed(OF_KEY_CONTROL) ? 2 : 0) |
+                              (ofGetKeyPressed(OF_KEY_ALT) ? 4 : 0) | (ofGetKeyPressed(OF_KEY_SUPER) ? 8 : 0);
+    values[STATE_FRAME_NUM] = ofGetFrameNum();
+    values[STATE_ELAPSED_TIME] = ofGetElapsedTimef();
+    values[STATE_LAST_FRAME_TIME] = ofGetLastFrameTime();
+    values[STATE_WINDOW_WIDTH] = ofGetWindowWidth();
+    values[STATE_WINDOW_HEIGHT] = ofGetWindowHeight();
+}
+
+void ofxDukBindings::publishState() {
+    lock_guard<mutex> guard(inputLock);
+    state = staging;
+}
+
+void ofxDukBindings::pushState() {
+    auto obj = duk.pushObject();
+    duk.pushExternalBuffer(&state, sizeof(state));
+    duk.pushBufferObject(-1, offsetof(InputState, values), sizeof(state.values), DUK_BUFOBJ_FLOAT64ARRAY);
+    duk.putPropString(obj, "values");
+    duk.pushBufferObject(-1, offsetof(InputState, mouseButtons), sizeof(state.mouseButtons), DUK_BUFOBJ_UINT8ARRAY);
+    duk.putPropString(obj, "mouseButtons");
+    duk.pushBufferObject(-1, offsetof(InputState, keys), sizeof(state.keys), DUK_BUFOBJ_UINT8ARRAY);
+    duk.putPropString(obj, "keys");
+    duk.pop();
+    duk.freeze(obj);
+}
+
+void ofxDukBindings::createEvents() {
     auto of_events = duk.pushObject();
-    // fill event slots with null
-    duk.putObjectNull(of_events, "update");
-    duk.putObjectNull(of_events, "draw");
-    duk.putObjectNull(of_events, "mouseMoved");
-    duk.putObjectNull(of_events, "mousePressed");
-    duk.putObjectNull(of_events, "mouseReleased");
-    duk.putObjectNull(of_events, "mouseDragged");
-    duk.putObjectNull(of_events, "mouseEntered");
-    duk.putObjectNull(of_events, "mouseExited");
-    duk.putObjectNull(of_events, "mouseScrolled");
-    duk.putObjectNull(of_events, "keyPressed");
-    duk.putObjectNull(of_events, "keyReleased");
-    duk.putObjectNull(of_events, "windowResized");
-    duk.putObjectNull(of_events, "dragEvent");
-    duk.putObjectNull(of_events, "gotMessage");
-    
-    duk.putPropString(of, "events");
-    
+    for (int i = 0; i < EVENT_COUNT; i++) {
+        EventSlot slot = (EventSlot)i;
+        duk.pushNull();
+        setHandler(duk, slot);
+        duk.pop();
+        duk.pushString(eventNames[slot]);
+        duk.pushFunction([this, slot](ofxDuktape& ctx) {
+            handlers[slot].push(ctx);
+            return 1;
+        }, 0);
+        duk.pushFunction([this, slot](ofxDuktape& ctx) {
+            setHandler(ctx, slot);
+            return 0;
+        }, 1);
+        duk.defineProperty(of_events, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER | DUK_DEFPROP_SET_ENUMERABLE);
+    }
+    events.reset(duk, of_events);
+    duk.pop();
+}
+
+void ofxDukBindings::setupFunctions(ofxDuktape& duk, duk_idx_t of) {
     duk.putObjectConstInts(of,{
+        {"INPUT_STRIDE", (int)inputStride},
+        {"INPUT_MOUSE_MOVED", EVENT_MOUSE_MOVED},
+        {"INPUT_MOUSE_PRESSED", EVENT_MOUSE_PRESSED},
+        {"INPUT_MOUSE_RELEASED", EVENT_MOUSE_RELEASED},
+        {"INPUT_MOUSE_DRAGGED", EVENT_MOUSE_DRAGGED},
+        {"INPUT_MOUSE_ENTERED", EVENT_MOUSE_ENTERED},
+        {"INPUT_MOUSE_EXITED", EVENT_MOUSE_EXITED},
+        {"INPUT_MOUSE_SCROLLED", EVENT_MOUSE_SCROLLED},
+        {"INPUT_KEY_PRESSED", EVENT_KEY_PRESSED},
+        {"INPUT_KEY_RELEASED", EVENT_KEY_RELEASED},
+        
+        {"STATE_MOUSE_X", STATE_MOUSE_X},
+        {"STATE_MOUSE_Y", STATE_MOUSE_Y},
+        {"STATE_PREVIOUS_MOUSE_X", STATE_PREVIOUS_MOUSE_X},
+        {"STATE_PREVIOUS_MOUSE_Y", STATE_PREVIOUS_MOUSE_Y},
+        {"STATE_MOUSE_PRESSED", STATE_MOUSE_PRESSED},
+        {"STATE_ANY_KEY_PRESSED", STATE_ANY_KEY_PRESSED},
+        {"STATE_MODIFIERS", STATE_MODIFIERS},
+        {"STATE_FRAME_NUM", STATE_FRAME_NUM},
+        {"STATE_ELAPSED_TIME", STATE_ELAPSED_TIME},
+        {"STATE_LAST_FRAME_TIME", STATE_LAST_FRAME_TIME},
+        {"STATE_WINDOW_WIDTH", STATE_WINDOW_WIDTH},
+        {"STATE_WINDOW_HEIGHT", STATE_WINDOW_HEIGHT},
+        
         {"LOOP_NONE", OF_LOOP_NONE},
         {"LOOP_PALINDROME", OF_LOOP_PALINDROME},
         {"LOOP_NORMAL",OF_LOOP_NORMAL},
@@ -578,6 +1063,7 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
         {"versionMajor", [](ofxDuktape& duk){ duk.pushUint(ofGetVersionMajor()); return 1; }},
         {"versionMinor", [](ofxDuktape& duk){ duk.pushUint(ofGetVersionMinor()); return 1; }},
         {"versionPatch", [](ofxDuktape& duk){ duk.pushUint(ofGetVersionPatch()); return 1; }},
+        {"heapStats", [](ofxDuktape& duk){ duk.pushHeapStats(); return 1; }},
     });
     
     duk.putObjectGettersSetters(of,{
@@ -634,15 +1120,13 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
          */
     });
     
+    // plain functions get typed bindings, generated at compile time
+    duk.putObjectFunction(of, "enableArbTex", &ofEnableArbTex);
+    duk.putObjectFunction(of, "disableArbTex", &ofDisableArbTex);
+    duk.putObjectFunction(of, "disableAlphaBlending", &ofDisableAlphaBlending);
+    duk.putObjectFunction(of, "enableAlphaBlending", &ofEnableAlphaBlending);
+    
     duk.putObjectFunctions(of, {
-        {"enableArbTex", [](ofxDuktape&duk) {
-            ofEnableArbTex();
-            return 0;
-        }, 0},
-        {"disableArbTex", [](ofxDuktape&duk) {
-            ofDisableArbTex();
-            return 0;
-        }, 0},
         {"clear", [](ofxDuktape&duk) {
             ofClear(duk.getInt(0),
                     duk.getInt(1),
@@ -650,7 +1134,7 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
             return 0;
         }, 3},
         {"background", [&](ofxDuktape& duk) {
-            switch(duk.getTop()-2) {
+            switch(duk.getTop()) {
                 case 4:
                     ofBackground(duk.getInt(0),
                                  duk.getInt(1),
@@ -677,12 +1161,10 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
                                  ofColorFromObject(duk, 1));
             return 0;
         }, 2},
-        {"disableAlphaBlending", [](ofxDuktape&) { ofDisableAlphaBlending(); return 0; }, 0},
-        {"enableAlphaBlending", [](ofxDuktape&) { ofEnableAlphaBlending(); return 0; }, 0},
         {"color", [](ofxDuktape& duk) {
             //ofLogNotice("of.color")<<duk.getTop();
             //ofLogNotice("of.color")<<duk.toString(4)<<", " << duk.getType(5);
-            switch(duk.getTop()-2) {
+            switch(duk.getTop()) {
                 case 4:
                     objectFromofColor(duk, ofColor(duk.getNumber(0),
                                                    duk.getNumber(1),
@@ -791,7 +1273,7 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
             return 0;
         }, 2},
         {"drawLine", [](ofxDuktape& duk) {
-            switch (duk.getTop()-2) {
+            switch (duk.getTop()) {
                 case 6:
                     ofDrawLine(duk.getNumber(0),
                                duk.getNumber(1),
@@ -816,7 +1298,7 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
             return 0;
         }, DUK_VARARGS},
         {"drawBezier", [](ofxDuktape& duk) {
-            switch (duk.getTop()-2) {
+            switch (duk.getTop()) {
                 case 12:
                     ofDrawBezier(duk.getNumber(0), duk.getNumber(1), duk.getNumber(2),
                                  duk.getNumber(3), duk.getNumber(4), duk.getNumber(5),
@@ -847,8 +1329,104 @@ ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
             return 0;
         }, DUK_VARARGS},
     });
+}
+
+static const char* ofxDukBindingsShared = DUK_HIDDEN_SYMBOL("ofxDukBindingsShared");
+
+void ofxDukBindings::setupTemplate(ofxDuktape& duk) {
+    auto of = duk.pushObject();
+    duk.putObjectBool(of, ofxDukBindingsShared, true);
+    setupFunctions(duk, of);
+    duk.putGlobalString("of");
     
+    // Logger
+    duk.putGlobalStringFunction("log", [](ofxDuktape& duk) {
+        ofLogNotice() << duk.safeToString(0); return 0;
+    }, 1);
+}
+
+ofxDukBindings& ofxDukBindings::setup(ofxDuktape& duk) {
+    // a sandbox of a template set up with setupTemplate() already has the
+    // functions and constants in a shared `of`, which its own `of` inherits from
+    bool shared = false;
+    if (duk.getGlobalString("of") && duk.isObject(-1)) {
+        shared = duk.getPropString(-1, ofxDukBindingsShared);
+        duk.pop();
+    }
+    duk.pop();
+    auto of = duk.pushObject();
+    if (shared) {
+        duk.setPrototypeGlobalString(of, "of");
+    }
+    
+    // deletes itself when duk is destroyed (see onDestroy())
+    ofxDukBindings* bindings = new ofxDukBindings(duk);
+    bindings->promises.setup();
+    
+    bindings->pushState();
+    duk.putPropString(of, "state");
+    
+    // of.events is read through accessors, so the events object stays the one
+    // whose setters keep the handler cache. assigning an object to it copies the
+    // handlers over instead
+    bindings->createEvents();
+    duk.pushString("events");
+    duk.pushFunction([bindings](ofxDuktape& ctx) {
+        bindings->events.push(ctx);
+        return 1;
+    }, 0);
+    duk.pushFunction([bindings](ofxDuktape& ctx) {
+        if (!ctx.isObject(0)) return 0;
+        bindings->events.push(ctx);
+        for (int i = 0; i < EVENT_COUNT; i++) {
+            ctx.getPropString(0, eventNames[i]);
+            ctx.putPropString(1, eventNames[i]);
+        }
+        return 0;
+    }, 1);
+    duk.defineProperty(of, DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_HAVE_SETTER | DUK_DEFPROP_SET_ENUMERABLE);
+    
+    // listeners are pinned from the main stack, like handlers
+    duk.putObjectFunction(of, "addEventListener", [bindings](ofxDuktape& ctx) {
+        EventSlot slot;
+        if (!slotForName(ctx.requireCString(0), slot)) {
+            // the message is gone before the throw, which skips destructors
+            ctx.pushError(DUK_ERR_TYPE_ERROR, string("unknown event type ") + ctx.getCString(0));
+            ctx._throw();
+        }
+        ctx.requireCallable(1);
+        int priority = ctx.isNumber(2) ? ctx.getInt(2) : 0;
+        ofxDuktape& duk = bindings->duk;
+        ctx.dup(1);
+        if (&ctx != &duk) {
+            duk.xcopyTop(&ctx, 1);
+            ctx.pop();
+        }
+        bindings->addEventListener(slot, -1, priority);
+        duk.pop();
+        return 0;
+    }, 3);
+    duk.putObjectFunction(of, "removeEventListener", [bindings](ofxDuktape& ctx) {
+        EventSlot slot;
+        if (!slotForName(ctx.safeToCString(0), slot)) return 0;
+        ofxDuktape& duk = bindings->duk;
+        ctx.dup(1);
+        if (&ctx != &duk) {
+            duk.xcopyTop(&ctx, 1);
+            ctx.pop();
+        }
+        bindings->removeEventListener(slot, -1);
+        duk.pop();
+        return 0;
+    }, 2);
+    
+    if (!shared) {
+        setupFunctions(duk, of);
+    }
     duk.putGlobalString("of");
+    if (shared) {
+        return *bindings;
+    }
     
     // Logger
     duk.putGlobalStringFunction("log", [&](ofxDuktape& duk) {
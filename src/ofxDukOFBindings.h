@@ -10,14 +10,138 @@
 
 #include "ofMain.h"
 #include "ofxDuktape.h"
+#include "ofxDuktapePromise.h"
+#include "ofxDuktapeFrameGC.h"
+#include "ofxDuktapeWorker.h"
 
 class ofxDukBindings {
     
     ofxDuktape& duk;
+    ofxDuktapePromises promises;
+    ofxDuktapeFrameGC frameGC;
+    
+    // pipelining (see setPipelined()), off while the pool is NULL. the pool job
+    // owns the heap and nextScene until it clears pipelineBusy
+    ofxDuktapeWorkerPool* pipelinePool;
+    ofxDukRef drawFunction;
+    string scene;
+    string nextScene;
+    mutex pipelineLock;
+    condition_variable pipelineIdle;
+    bool pipelineBusy;
+    void startPipeline();
+    void waitPipeline();
+    void drawScene();
+    
+    // the of.events slots. scripts assign handlers through setters that keep
+    // them here, so dispatch needs no property lookups
+    enum EventSlot {
+        EVENT_UPDATE, EVENT_DRAW,
+        EVENT_MOUSE_MOVED, EVENT_MOUSE_PRESSED, EVENT_MOUSE_RELEASED, EVENT_MOUSE_DRAGGED,
+        EVENT_MOUSE_ENTERED, EVENT_MOUSE_EXITED, EVENT_MOUSE_SCROLLED,
+        EVENT_KEY_PRESSED, EVENT_KEY_RELEASED,
+        EVENT_WINDOW_RESIZED, EVENT_DRAG, EVENT_GOT_MESSAGE,
+        EVENT_INPUT,
+        EVENT_COUNT
+    };
+    static const char* eventNames[EVENT_COUNT];
+    ofxDukRef events;
+    ofxDukRef handlers[EVENT_COUNT];
+    bool callable[EVENT_COUNT];
+    void createEvents();
+    // stores the value on top of ctx's stack as the handler for slot
+    void setHandler(ofxDuktape& ctx, EventSlot slot);
+    // listeners added with addEventListener(), sorted by priority. while a
+    // dispatch is running, removed ones are only marked and added ones wait in
+    // pendingListeners, so the lists can be walked by index
+    struct Listener {
+        ofxDukRef fn;
+        int priority;
+        bool removed;
+    };
+    vector<Listener> listeners[EVENT_COUNT];
+    vector<pair<EventSlot, Listener>> pendingListeners;
+    int dispatching;
+    bool listenersDirty;
+    // takes a C string, so script-facing callers hold no std::string while
+    // Duktape errors (which longjmp past destructors) can be thrown
+    static bool slotForName(const char* type, EventSlot& slot);
+    void addEventListener(EventSlot slot, duk_idx_t index, int priority);
+    bool removeEventListener(EventSlot slot, duk_idx_t index);
+    void insertListener(EventSlot slot, Listener&& listener);
+    void flushListeners();
+    inline bool hasListeners(EventSlot slot) const { return callable[slot] || !listeners[slot].empty(); }
+    // calls the of.events handler and then the listeners of slot, each in a
+    // protected call, with the nargs values on top of the stack, and pops them.
+    // what the handler returned goes into result, if given
+    void dispatch(EventSlot slot, int nargs, string* result = NULL);
+    bool invoke(EventSlot slot, const ofxDukRef& fn, duk_idx_t args, int nargs);
+    
+    // batched input (see setInputBatching()): records of inputStride numbers,
+    // queued on the main thread and handed over at the next update
+    static const size_t inputStride = 6;
+    bool inputBatching;
+    mutex inputLock;
+    vector<double> inputQueue;
+    vector<double> inputBatch;
+    void queueInput(EventSlot type, double a, double b, double c, double d, double e);
+    void deliverInput();
+    
+    // pool reading dropped files (see setDragLoading()), NULL when off. loads
+    // in flight are counted so they can be waited for, and the calls they post
+    // check alive, which the destructor clears, before touching the bindings
+    ofxDuktapeWorkerPool* dragPool;
+    mutex dragLock;
+    condition_variable dragIdle;
+    int dragLoads;
+    shared_ptr<bool> alive;
+    void loadDropped(const ofDragInfo& dragInfo);
+    void waitDragLoads();
+    
+    // input state block, read by scripts through typed arrays over its memory
+    // (of.state). staging is kept up to date on the main thread, under inputLock,
+    // and copied to state at the start of every update
+    enum StateValue {
+        STATE_MOUSE_X, STATE_MOUSE_Y, STATE_PREVIOUS_MOUSE_X, STATE_PREVIOUS_MOUSE_Y,
+        STATE_MOUSE_PRESSED, STATE_ANY_KEY_PRESSED, STATE_MODIFIERS,
+        STATE_FRAME_NUM, STATE_ELAPSED_TIME, STATE_LAST_FRAME_TIME,
+        STATE_WINDOW_WIDTH, STATE_WINDOW_HEIGHT,
+        STATE_COUNT
+    };
+    static const size_t stateMouseButtons = 8;
+    static const size_t stateKeys = 4096;
+    struct InputState {
+        double values[STATE_COUNT];
+        uint8_t mouseButtons[stateMouseButtons];
+        uint8_t keys[stateKeys];
+    };
+    InputState state;
+    InputState staging;
+    // keys and buttons down in staging
+    int keysDown;
+    int buttonsDown;
+    void trackKey(const ofKeyEventArgs& ev);
+    void trackMouse(const ofMouseEventArgs& ev);
+    void captureState();
+    void publishState();
+    void pushState();
     ofxDukBindings(ofxDuktape& duk);
     virtual ~ofxDukBindings();
+    // the bindings go away along with the ofxDuktape they were set up on
+    void onDestroy(ofxDuktape::DestroyEvent& ev);
     
+    void onFrameStart(ofEventArgs& ev);
     void onUpdate(ofEventArgs& ev);
+    // runs the calls posted to the heap, of.events.update and the promise jobs;
+    // encodes what update returned into scene, if given
+    void update(string* scene = NULL);
+    void keyEvent(const ofKeyEventArgs& ev);
+    static EventSlot mouseSlot(const ofMouseEventArgs& ev);
+    void mouseEvent(const ofMouseEventArgs& ev);
+    // buffers, when given, are the files' contents, in order; invalid ones pass null
+    void dragEvent(const ofDragInfo& dragInfo, vector<ofxDukTransfer>* buffers = NULL);
+    void windowResizeEvent(const ofResizeEventArgs& ev);
+    void messageEvent(const ofMessage& message);
     void onDraw(ofEventArgs& ev);
     void onKeyEvent(ofKeyEventArgs& ev);
     void onMouseEvent(ofMouseEventArgs& ev);
@@ -25,6 +149,80 @@ class ofxDukBindings {
     void onWindowResizeEvent(ofResizeEventArgs& ev);
     void onMessageEvent(ofMessage& message);
     
+    // every instance, and the pool updating them in parallel (NULL when serial).
+    // bindings on threads the addon frees go away from whichever thread
+    // collects them, so the list is only used under instancesLock
+    static vector<ofxDukBindings*>& getInstances();
+    static mutex instancesLock;
+    static ofxDuktapeWorkerPool* parallelPool;
+    static void onParallelUpdate(ofEventArgs& ev);
+    
+    // puts the functions and constants into the `of` object at index
+    static void setupFunctions(ofxDuktape& duk, duk_idx_t of);
+    
 public:
+    // the bindings live until duk is destroyed, or for the threads the addon
+    // frees itself (pushThread() and the like) until the thread is collected;
+    // the functions they put in the heap must not be called after that
     static ofxDukBindings& setup(ofxDuktape& duk);
+    // sets up a template heap (see ofxDuktapeTemplate) with a shared `of` holding
+    // just the functions and constants; setup() on each of its sandboxes then only
+    // adds what is per sandbox
+    static void setupTemplate(ofxDuktape& duk);
+    // every update runs the calls posted to the heap, then of.events.update,
+    // then drains the promise jobs
+    inline ofxDuktapePromises& getPromises() { return promises; }
+    // collections are deferred from before the app's update until after the
+    // app's draw, and run in what is left of the frame
+    inline ofxDuktapeFrameGC& getFrameGC() { return frameGC; }
+    
+    // runs the updates of all heaps at once on the pool, the main thread joining
+    // in, and waits for every one of them before the app's draw. bindings sharing
+    // a heap (sandboxes of one template) update one after the other on the same
+    // thread. update handlers then run off the main thread, so they must not
+    // touch GL or anything else shared between heaps. NULL goes back to serial
+    static void setParallelUpdate(ofxDuktapeWorkerPool* pool);
+    static inline bool isParallelUpdate() { return parallelPool != NULL; }
+    
+    // runs this heap's update on the pool one frame ahead of drawing. whatever
+    // of.events.update returns is the frame's scene: it's CBOR-encoded and, on
+    // the next frame, passed to the function at drawIndex of drawHeap, which
+    // renders it on the main thread while the pool already updates the frame
+    // after. drawHeap has to be another heap (ofxDukBindings::setupTemplate()
+    // gives it the `of` functions); this heap's of.events.draw isn't called.
+    // refused (and logged) if drawHeap or other bindings, like the sandboxes of
+    // a template, share this heap; don't set up bindings on it while pipelined.
+    // input events wait for the next update, as calls posted to the heap.
+    // setPipelined(NULL) waits for the pool and goes back to updating in place
+    void setPipelined(ofxDuktapeWorkerPool* pool, ofxDuktape* drawHeap = NULL, duk_idx_t drawIndex = -1);
+    inline bool isPipelined() const { return pipelinePool != NULL; }
+    
+    // queues mouse and key events instead of dispatching each one, and passes
+    // them to of.events.input(records) once per update, before of.events.update.
+    // records is a Float64Array of of.INPUT_STRIDE numbers per event: the type
+    // (of.INPUT_MOUSE_MOVED, of.INPUT_KEY_PRESSED, ...), then x, y, button,
+    // scrollX and scrollY for mouse events, or key, keycode, scancode and
+    // codepoint for key events. consecutive moves collapse into the last one,
+    // drags too while the button stays the same, and consecutive scrolls add up.
+    // the per-event mouse and key handlers aren't called meanwhile
+    void setInputBatching(bool enabled);
+    inline bool isInputBatching() const { return inputBatching; }
+    
+    // adds the function at index as a listener for an of.events type, called
+    // after the of.events handler. lower priorities go first, equal ones in the
+    // order they were added; adding a function twice does nothing. scripts get
+    // the pair as of.addEventListener(type, fn, priority = 0) and
+    // of.removeEventListener(type, fn). false for an unknown type
+    bool addEventListener(const string& type, duk_idx_t index, int priority = 0);
+    bool removeEventListener(const string& type, duk_idx_t index);
+    
+    // reads dropped files on the pool instead of handing scripts just the paths.
+    // once all of a drop's files are read, the dragEvent handler gets the event
+    // with a buffers array holding an ArrayBuffer per file (null for files that
+    // couldn't be read), delivered at the start of an update. the memory is read
+    // into straight from the file and adopted by the heap without a copy.
+    // NULL goes back to paths only, waiting for the loads in flight, as does
+    // destroying the bindings
+    void setDragLoading(ofxDuktapeWorkerPool* pool);
+    inline bool isDragLoading() const { return dragPool != NULL; }
 };
@@ -6,60 +6,221 @@
 //
 
 #include "ofxDuktape.h"
+#include "ofxDuktapePool.h"
+#include <random>
 
 const char* ofxDuktapeProp = "\xff""ofxDuktape";
-static void* ofxDuktapeMalloc(ofxDuktape* duk, duk_size_t size) {
-    return malloc(size);
-}
-static void* ofxDuktapeRealloc(ofxDuktape* duk, void* ptr, duk_size_t size) {
-    return realloc(ptr, size);
-}
-static void ofxDuktapeFree(ofxDuktape* duk, void* ptr) {
-    return free(ptr);
+// malloc-backed blocks carry their size so frees can be accounted for
+union ofxDuktapeMallocHeader {
+    size_t size;
+    double align;
+};
+
+// allocator hooks; the udata handed to duk_create_heap is the owning ofxDuktape
+struct ofxDuktapeAllocator {
+    // a failed request is tried once, then retried after each of up to 10
+    // collections (DUK_HEAP_ALLOC_FAIL_MARKANDSWEEP_LIMIT in duktape.c)
+    static const int refusalsPerRequest = 11;
+    static inline bool withinLimit(ofxDuktape* duk, size_t growth) {
+        if (!duk->memoryLimit || duk->heapStats.liveBytes + growth <= duk->memoryLimit) {
+            // the collector allocates and compacts between retries, so only a
+            // request at least as big as the refused one ends the episode
+            if (growth >= duk->memoryLimitRefused) duk->memoryLimitRefused = 0;
+            return true;
+        }
+        // record one event per refused request, counting its retries out. they
+        // are delivered once the protected call running it has returned, since
+        // listeners can't run in the middle of an allocation
+        if (duk->memoryLimitRefused != growth || duk->memoryLimitRefusals >= refusalsPerRequest) {
+            duk->memoryLimitRefused = growth;
+            duk->memoryLimitRefusals = 0;
+            ofxDuktape::MemoryLimitEvent ev;
+            ev.duk = duk;
+            ev.requested = growth;
+            ev.liveBytes = duk->heapStats.liveBytes;
+            ev.limit = duk->memoryLimit;
+            duk->memoryLimitEvents.push_back(ev);
+        }
+        duk->memoryLimitRefusals++;
+        return false;
+    }
+    static inline bool admit(ofxDuktape* duk, size_t growth) {
+        return withinLimit(duk, growth);
+    }
+    static inline size_t growth(size_t old_size, size_t size) {
+        return size > old_size ? size - old_size : 0;
+    }
+
+    static inline void trackAlloc(ofxDuktape* duk, size_t size) {
+        ofxDuktape::HeapStats& stats = duk->heapStats;
+        stats.allocCount++;
+        stats.liveBytes += size;
+        if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+        trackSize(stats, size);
+    }
+    static inline void trackRealloc(ofxDuktape* duk, size_t old_size, size_t size) {
+        ofxDuktape::HeapStats& stats = duk->heapStats;
+        stats.reallocCount++;
+        stats.liveBytes += size - old_size;
+        if (stats.liveBytes > stats.peakBytes) stats.peakBytes = stats.liveBytes;
+        trackSize(stats, size);
+    }
+    static inline void trackFree(ofxDuktape* duk, size_t size) {
+        ofxDuktape::HeapStats& stats = duk->heapStats;
+        stats.freeCount++;
+        stats.liveBytes -= size;
+    }
+    static inline void trackSize(ofxDuktape::HeapStats& stats, size_t size) {
+        uint32_t sizeClass = ofxDuktapePool::classForSize(size);
+        stats.histogram[sizeClass == ofxDuktapePool::largeClass ? ofxDuktapePool::numSizeClasses : sizeClass]++;
+    }
+
+    static void* malloc(ofxDuktape* duk, duk_size_t size) {
+        if (!admit(duk, size)) return NULL;
+        ofxDuktapeMallocHeader* header = (ofxDuktapeMallocHeader*)::malloc(sizeof(ofxDuktapeMallocHeader) + size);
+        if (!header) return NULL;
+        header->size = size;
+        trackAlloc(duk, size);
+        return header + 1;
+    }
+    static void* realloc(ofxDuktape* duk, void* ptr, duk_size_t size) {
+        if (!ptr) return malloc(duk, size);
+        if (size == 0) {
+            free(duk, ptr);
+            return NULL;
+        }
+        ofxDuktapeMallocHeader* header = (ofxDuktapeMallocHeader*)ptr - 1;
+        size_t old_size = header->size;
+        if (!admit(duk, growth(old_size, size))) return NULL;
+        header = (ofxDuktapeMallocHeader*)::realloc(header, sizeof(ofxDuktapeMallocHeader) + size);
+        if (!header) return NULL;
+        header->size = size;
+        trackRealloc(duk, old_size, size);
+        return header + 1;
+    }
+    static void free(ofxDuktape* duk, void* ptr) {
+        if (!ptr) return;
+        ofxDuktapeMallocHeader* header = (ofxDuktapeMallocHeader*)ptr - 1;
+        trackFree(duk, header->size);
+        ::free(header);
+    }
+
+    static void* poolMalloc(ofxDuktape* duk, duk_size_t size) {
+        if (!admit(duk, size)) return NULL;
+        void* ptr = duk->pool->alloc(size);
+        if (ptr) trackAlloc(duk, size);
+        return ptr;
+    }
+    static void* poolRealloc(ofxDuktape* duk, void* ptr, duk_size_t size) {
+        if (!ptr) return poolMalloc(duk, size);
+        if (size == 0) {
+            poolFree(duk, ptr);
+            return NULL;
+        }
+        size_t old_size = ofxDuktapePool::blockSize(ptr);
+        if (!admit(duk, growth(old_size, size))) return NULL;
+        void* moved = duk->pool->realloc(ptr, size);
+        if (moved) trackRealloc(duk, old_size, size);
+        return moved;
+    }
+    static void poolFree(ofxDuktape* duk, void* ptr) {
+        if (!ptr) return;
+        trackFree(duk, ofxDuktapePool::blockSize(ptr));
+        duk->pool->free(ptr);
+    }
+
+    // takes a block the heap let go of (see duk_steal_buffer) out of its
+    // accounting, returning the malloc'd block it lives in. blocks living in
+    // pool slabs are copied out first, updating ptr
+    static void* adopt(ofxDuktape* duk, void*& ptr, size_t size) {
+        if (duk->allocatorMode == ofxDuktape::ALLOCATOR_POOL) {
+            ofxDuktapePool::BlockHeader* header = (ofxDuktapePool::BlockHeader*)((char*)ptr - ofxDuktapePool::headerSize);
+            if (header->sizeClass == ofxDuktapePool::largeClass) {
+                trackFree(duk, header->size);
+                return header;
+            }
+            void* block = ::malloc(size ? size : 1);
+            if (block) memcpy(block, ptr, size);
+            poolFree(duk, ptr);
+            ptr = block;
+            return block;
+        }
+        ofxDuktapeMallocHeader* header = (ofxDuktapeMallocHeader*)ptr - 1;
+        trackFree(duk, header->size);
+        return header;
+    }
+};
+
+static void ofxDuktapeFatal(ofxDuktape* duk, const char* msg) {
+    ofLogFatalError("ofxDuktape", string("Fatal error in ofxDuktape object ")+ ofToString(duk) + ": " + msg);
+    ofxDuktape::ErrorData err;
+    err.code = DUK_ERR_ERROR;
+    err.description = msg ? msg : "";
+    ofNotifyEvent(duk->onFatalError, err);
 }
-static void ofxDuktapeFatal(duk_context *ctx, duk_errcode_t code, const char* msg) {
-    duk_memory_functions mem;
-    duk_get_memory_functions(ctx, &mem);
-    ofLogFatalError("ofxDuktape", string("Fatal error in ofxDuktape object ")+ ofToString(mem.udata) + " code " + ofToString(code) + ": " + msg);
+
+// ArrayBuffers pushed with pushTransfer() keep their external plain buffer and
+// the malloc'd block backing it in these
+static const char* ofxDukTransferBuffer = DUK_HIDDEN_SYMBOL("ofxDukTransferBuffer");
+static const char* ofxDukTransferBlock = DUK_HIDDEN_SYMBOL("ofxDukTransferBlock");
+
+static duk_ret_t ofxDuktapeTransferFinalizer(duk_context* ctx) {
+    duk_get_prop_string(ctx, 0, ofxDukTransferBlock);
+    void* block = duk_get_pointer(ctx, -1);
+    if (block && duk_get_prop_string(ctx, 0, ofxDukTransferBuffer)) {
+        // anything still looking at the plain buffer sees it empty
+        duk_config_buffer(ctx, -1, NULL, 0);
+    }
+    ::free(block);
+    return 0;
 }
 
 void ofxDuktape::threadSetup() {
     pushCurrentThreadStash();
     putObjectPointer(-1, ofxDuktapeProp, (void*)this);
-    /*
-    setFinalizerFunction(-1, [](ofxDuktape&duk) {
-        duk.pushCurrentThreadStash();
-        ofxDuktape *dduk = static_cast<ofxDuktape*>(duk.getObjectPointer(-1, ofxDuktapeProp));
-        if(dduk) delete dduk;
-        duk.putObjectPointer(-1, ofxDuktapeProp, 0);
-        return 0;
-    });
-    */
+    // wrappers of threads the addon creates are deleted by a finalizer on
+    // the thread itself (see ofxDuktapeDispatch::adoptThread)
     pop();
 }
 
-duk_idx_t ofxDuktape::pushThread() {
-    duk_idx_t thread = duk_push_thread(ctx);
-    duk_context *octx = duk_get_context(ctx, thread);
-    pushThreadStash(thread);
-    if(!hasPropString(-1, ofxDuktapeProp)) {
-        ofxDuktape *duk = new ofxDuktape(this, octx);
-        putObjectPointer(-1, ofxDuktapeProp, duk);
+void ofxDuktape::createHeap(AllocatorMode mode) {
+    allocatorMode = mode;
+    threadPoolLimit = 16;
+    memset(&heapStats, 0, sizeof(heapStats));
+    memoryLimit = 0;
+    memoryLimitRefused = 0;
+    memoryLimitRefusals = 0;
+    gcTriggerAllocs = gcSpan = gcMinAllocs;
+    gcDeferred = 0;
+    memset(&gcStats, 0, sizeof(gcStats));
+    memset(&budget, 0, sizeof(budget));
+    interruptCount = 0;
+    if (mode == ALLOCATOR_POOL) {
+        pool = new ofxDuktapePool();
+        ctx = duk_create_heap((duk_alloc_function)ofxDuktapeAllocator::poolMalloc,
+                              (duk_realloc_function)ofxDuktapeAllocator::poolRealloc,
+                              (duk_free_function)ofxDuktapeAllocator::poolFree,
+                              (void*)this,
+                              (duk_fatal_function)ofxDuktapeFatal);
+    } else {
+        ctx = duk_create_heap((duk_alloc_function)ofxDuktapeAllocator::malloc,
+                              (duk_realloc_function)ofxDuktapeAllocator::realloc,
+                              (duk_free_function)ofxDuktapeAllocator::free,
+                              (void*)this,
+                              (duk_fatal_function)ofxDuktapeFatal);
     }
-    pop();
-    return thread;
 }
-ofxDuktape::ofxDuktape(): ctx(NULL) {
-    ctx = duk_create_heap((duk_alloc_function)ofxDuktapeMalloc,
-                          (duk_realloc_function)ofxDuktapeRealloc,
-                          (duk_free_function)ofxDuktapeFree,
-                          (void*)this,
-                          (duk_fatal_function)ofxDuktapeFatal);
+
+ofxDuktape::ofxDuktape(AllocatorMode mode): ctx(NULL), pool(NULL), refStash(NULL), pooledRef(-1) {
+    createHeap(mode);
     threadSetup();
 }
 
-ofxDuktape::ofxDuktape(ofxDuktape*parent, bool newenv) {
+ofxDuktape::ofxDuktape(ofxDuktape*parent, bool newenv): pool(NULL), memoryLimit(0), memoryLimitRefused(0), memoryLimitRefusals(0), refStash(NULL), pooledRef(-1) {
+    memset(&heapStats, 0, sizeof(heapStats));
     if(parent && parent->ctx) {
+        // threads allocate through the parent heap
+        allocatorMode = parent->allocatorMode;
         if(newenv){
             duk_push_thread_new_globalenv(parent->ctx);
         } else {
@@ -67,24 +228,369 @@ ofxDuktape::ofxDuktape(ofxDuktape*parent, bool newenv) {
         }
         ctx = duk_get_context(parent->ctx, -1);
     } else {
-        ctx = duk_create_heap((duk_alloc_function)ofxDuktapeMalloc,
-                              (duk_realloc_function)ofxDuktapeRealloc,
-                              (duk_free_function)ofxDuktapeFree,
-                              (void*)this,
-                              (duk_fatal_function)ofxDuktapeFatal);
+        createHeap(ALLOCATOR_MALLOC);
     }
     threadSetup();
 }
-ofxDuktape::ofxDuktape(ofxDuktape*parent, duk_context *other_ctx) {
+ofxDuktape::ofxDuktape(ofxDuktape*parent, duk_context *other_ctx): pool(NULL), memoryLimit(0), memoryLimitRefused(0), memoryLimitRefusals(0), refStash(NULL), pooledRef(-1) {
+    memset(&heapStats, 0, sizeof(heapStats));
+    allocatorMode = parent ? parent->allocatorMode : ALLOCATOR_MALLOC;
     ctx = other_ctx;
     threadSetup();
 }
 
 ofxDuktape::~ofxDuktape() {
+    // NULL when deleted from the finalizer of its thread, which is going away
+    if (!ctx) return;
+    DestroyEvent ev;
+    ev.duk = this;
+    ofNotifyEvent(onDestroy, ev);
     pushCurrentThreadStash();
     // clear internal pointer to avoid double-freeing oneself
     putObjectHeapPtr(-1, ofxDuktapeProp, 0);
+    pop();
+    if (getHeapOwner() != this) {
+        // a thread of another heap, which its garbage collector takes care of
+        return;
+    }
     duk_destroy_heap(ctx);
+    // the pool has to outlive the heap, which frees through it on destruction
+    delete pool;
+}
+
+ofxDuktape* ofxDuktape::getHeapOwner() {
+    // threads share the allocator (and its state) of the heap owner
+    duk_memory_functions mem;
+    duk_get_memory_functions(ctx, &mem);
+    return (ofxDuktape*)mem.udata;
+}
+
+const ofxDuktape::HeapStats& ofxDuktape::getHeapStats() {
+    return getHeapOwner()->heapStats;
+}
+
+void ofxDuktape::setMemoryLimit(size_t bytes) {
+    ofxDuktape* owner = getHeapOwner();
+    owner->memoryLimit = bytes;
+    owner->memoryLimitRefused = 0;
+    owner->memoryLimitRefusals = 0;
+}
+
+size_t ofxDuktape::getMemoryLimit() {
+    return getHeapOwner()->memoryLimit;
+}
+
+void ofxDuktape::notifyMemoryLimit() {
+    // listeners may run scripts that get refused again; those events wait for
+    // the next protected call to return
+    vector<MemoryLimitEvent> events;
+    events.swap(memoryLimitEvents);
+    memoryLimitRefused = 0;
+    memoryLimitRefusals = 0;
+    for (MemoryLimitEvent& ev : events) {
+        ofNotifyEvent(onMemoryLimit, ev);
+    }
+}
+
+void ofxDuktape::gc() {
+    uint64_t start = ofGetElapsedTimeMicros();
+    duk_gc(ctx, 0);
+    getHeapOwner()->finishCollection(ofGetElapsedTimeMicros() - start, false);
+}
+
+bool ofxDuktape::collectIfDue() {
+    ofxDuktape* owner = getHeapOwner();
+    uint64_t trigger = owner->gcTriggerAllocs;
+    if (owner->gcDeferred) trigger += owner->gcSpan * (gcDeferLimit - 1);
+    if (owner->heapStats.allocCount < trigger) return false;
+    if (owner->gcDeferred) owner->gcStats.overdue++;
+    uint64_t start = ofGetElapsedTimeMicros();
+    duk_gc(ctx, 0);
+    owner->finishCollection(ofGetElapsedTimeMicros() - start, true);
+    return true;
+}
+
+void ofxDuktape::finishCollection(uint64_t micros, bool triggered) {
+    gcStats.collections++;
+    if (triggered) gcStats.triggered++;
+    gcStats.lastPauseMicros = micros;
+    gcStats.maxPauseMicros = std::max(gcStats.maxPauseMicros, micros);
+    gcStats.totalPauseMicros += micros;
+    // paced on what survived, roughly like Duktape's own trigger
+    uint64_t live = heapStats.allocCount - heapStats.freeCount;
+    gcSpan = std::max(gcMinAllocs, live * gcTriggerRatio);
+    gcTriggerAllocs = heapStats.allocCount + gcSpan;
+}
+
+void ofxDuktape::beginGCDeferral() {
+    getHeapOwner()->gcDeferred++;
+}
+
+void ofxDuktape::endGCDeferral() {
+    ofxDuktape* owner = getHeapOwner();
+    if (owner->gcDeferred > 0) owner->gcDeferred--;
+}
+
+bool ofxDuktape::isGCDeferred() {
+    return getHeapOwner()->gcDeferred > 0;
+}
+
+double ofxDuktape::getGCDebt() {
+    ofxDuktape* owner = getHeapOwner();
+    uint64_t since = owner->heapStats.allocCount + owner->gcSpan - owner->gcTriggerAllocs;
+    return (double)since / owner->gcSpan;
+}
+
+const ofxDuktape::GCStats& ofxDuktape::getGCStats() {
+    return getHeapOwner()->gcStats;
+}
+
+void ofxDuktape::setCompileCacheDirectory(const string& directory) {
+    string path;
+    if (!directory.empty()) {
+        path = ofToDataPath(directory, true);
+        ofDirectory::createDirectory(path, false, true);
+    }
+    getHeapOwner()->compileCacheDirectory = path;
+}
+
+string ofxDuktape::getCompileCacheDirectory() {
+    return getHeapOwner()->compileCacheDirectory;
+}
+
+// called by Duktape every DUK_HTHREAD_INTCTR_DEFAULT instructions, see duk_config.h
+extern "C" duk_bool_t ofxDuktapeExecTimeoutCheck(void *udata) {
+    ofxDuktape* owner = (ofxDuktape*)udata;
+    return owner && owner->checkExecutionBudget();
+}
+
+bool ofxDuktape::checkExecutionBudget() {
+    interruptCount++;
+    // once exceeded it has to keep failing until the error is out of Duktape
+    if (budget.exceeded) return true;
+    if ((budget.deadline && ofGetElapsedTimeMicros() >= budget.deadline) ||
+        (budget.interruptLimit && interruptCount >= budget.interruptLimit)) {
+        budget.exceeded = true;
+    }
+    return budget.exceeded;
+}
+
+ofxDuktape::ExecutionBudget ofxDuktape::makeBudget(uint64_t microseconds, uint64_t instructions) {
+    ExecutionBudget b;
+    b.deadline = microseconds ? ofGetElapsedTimeMicros() + microseconds : 0;
+    b.interruptLimit = instructions ? interruptCount + (instructions + interruptInterval - 1) / interruptInterval : 0;
+    b.exceeded = false;
+    return b;
+}
+
+void ofxDuktape::setExecutionBudget(uint64_t microseconds, uint64_t instructions) {
+    ofxDuktape* owner = getHeapOwner();
+    owner->budget = owner->makeBudget(microseconds, instructions);
+}
+
+void ofxDuktape::clearExecutionBudget() {
+    memset(&getHeapOwner()->budget, 0, sizeof(ExecutionBudget));
+}
+
+bool ofxDuktape::isExecutionBudgetExceeded() {
+    return getHeapOwner()->budget.exceeded;
+}
+
+// tightens the heap budget for the duration of a call and puts the old one back afterwards
+struct ofxDuktapeBudgetScope {
+    ofxDuktape* owner;
+    ofxDuktape::ExecutionBudget saved;
+    ofxDuktapeBudgetScope(ofxDuktape* owner, const ofxDuktape::ExecutionBudget& b): owner(owner), saved(owner->budget) {
+        ofxDuktape::ExecutionBudget& current = owner->budget;
+        if (b.deadline && (!current.deadline || b.deadline < current.deadline)) {
+            current.deadline = b.deadline;
+        }
+        if (b.interruptLimit && (!current.interruptLimit || b.interruptLimit < current.interruptLimit)) {
+            current.interruptLimit = b.interruptLimit;
+        }
+    }
+    ~ofxDuktapeBudgetScope() {
+        owner->budget = saved;
+    }
+};
+
+int ofxDuktape::pCallBudgeted(int num_arguments, uint64_t microseconds, uint64_t instructions) {
+    ofxDuktape* owner = getHeapOwner();
+    ofxDuktapeBudgetScope scope(owner, owner->makeBudget(microseconds, instructions));
+    return pCall(num_arguments);
+}
+
+int ofxDuktape::pEvalStringBudgeted(const string& s, uint64_t microseconds, uint64_t instructions) {
+    ofxDuktape* owner = getHeapOwner();
+    ofxDuktapeBudgetScope scope(owner, owner->makeBudget(microseconds, instructions));
+    return pEvalString(s);
+}
+
+void ofxDuktape::post(post_function fn) {
+    // the owner never changes, so reading it off the heap is safe from any thread
+    getHeapOwner()->postQueue.push(std::move(fn));
+}
+
+void ofxDuktape::post(const string& cbor, post_function fn) {
+    post([cbor, fn](ofxDuktape& duk) {
+        duk.cborDecode(cbor);
+        fn(duk);
+    });
+}
+
+size_t ofxDuktape::runPosted() {
+    ofxDuktapePostQueue& queue = getHeapOwner()->postQueue;
+    const void* end = queue.mark();
+    post_function fn;
+    size_t count = 0;
+    while (!queue.isPast(end) && queue.pop(fn)) {
+        duk_idx_t top = getTop();
+        int ret = safeCall([&fn](ofxDuktape& duk) {
+            fn(duk);
+            return 0;
+        }, 0, 1);
+        if (ret != DUK_EXEC_SUCCESS) {
+            ofLogError("ofxDuktape") << "posted call: " << safeToString(-1);
+        }
+        setTop(top);
+        count++;
+    }
+    return count;
+}
+
+// compile cache files are this header followed by the dumped bytecode. Duktape
+// trusts bytecode blindly, so the header and a hash of the bytecode are checked
+// before it is loaded. that catches damaged files, not crafted ones
+struct ofxDuktapeCacheHeader {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t pointerSize;
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint64_t bytecodeLength;
+    uint64_t bytecodeHash;
+};
+static const char ofxDuktapeCacheMagic[4] = {'o', 'd', 'b', '2'};
+static const uint64_t ofxDuktapeHashSeed = 0xcbf29ce484222325ULL;
+// tells apart the temp files of writes made at the same time
+static atomic<uint32_t> ofxDuktapeCacheWrites(0);
+
+// 64-bit FNV-1a
+static inline uint64_t ofxDuktapeHash(uint64_t hash, const void* data, size_t length) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ bytes[i]) * 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+int ofxDuktape::pCompileCached(const string* filename, const string& s, unsigned int flags) {
+    uint64_t hash = ofxDuktapeHashSeed;
+    // a missing filename hashes differently from an empty one
+    hash = ofxDuktapeHash(hash, filename ? "f" : "-", 1);
+    if (filename) hash = ofxDuktapeHash(hash, filename->c_str(), filename->length() + 1);
+    hash = ofxDuktapeHash(hash, &flags, sizeof(flags));
+    hash = ofxDuktapeHash(hash, s.c_str(), s.length());
+    
+    char name[64];
+    snprintf(name, sizeof(name), "%08lx-%016llx.dukbc", (unsigned long)DUK_VERSION, (unsigned long long)hash);
+    string path = ofFilePath::join(getHeapOwner()->compileCacheDirectory, name);
+    
+    ofxDuktapeCacheHeader expected;
+    memcpy(expected.magic, ofxDuktapeCacheMagic, sizeof(expected.magic));
+    expected.version = DUK_VERSION;
+    expected.flags = flags;
+    expected.pointerSize = sizeof(void*);
+    expected.sourceHash = hash;
+    expected.sourceLength = s.length();
+    
+    if (ofFile::doesFileExist(path, false)) {
+        ofBuffer cached = ofBufferFromFile(path, true);
+        ofxDuktapeCacheHeader header;
+        if (cached.size() >= sizeof(header)) {
+            memcpy(&header, cached.getData(), sizeof(header));
+            if (!memcmp(header.magic, expected.magic, sizeof(header.magic)) &&
+                header.version == expected.version &&
+                header.flags == expected.flags &&
+                header.pointerSize == expected.pointerSize &&
+                header.sourceHash == expected.sourceHash &&
+                header.sourceLength == expected.sourceLength &&
+                header.bytecodeLength == cached.size() - sizeof(header) &&
+                header.bytecodeHash == ofxDuktapeHash(ofxDuktapeHashSeed, cached.getData() + sizeof(header), header.bytecodeLength)) {
+                size_t length = header.bytecodeLength;
+                const char* bytecode = cached.getData() + sizeof(header);
+                int ret = safeCall([&](ofxDuktape& duk) {
+                    memcpy(duk.pushFixedBuffer(length), bytecode, length);
+                    duk_load_function(duk.ctx);
+                    return 1;
+                }, 0, 1);
+                if (ret == DUK_EXEC_SUCCESS) return 0;
+                pop();
+            }
+        }
+        // stale or damaged, it gets rewritten below
+    }
+    
+    int ret;
+    if (filename) {
+        pushString(*filename);
+        ret = duk_pcompile_lstring_filename(ctx, flags, s.c_str(), s.length());
+    } else {
+        ret = duk_pcompile_lstring(ctx, flags, s.c_str(), s.length());
+    }
+    if (ret != 0) return ret;
+    
+    dup(-1);
+    if (safeCall([](ofxDuktape& duk) {
+        duk_dump_function(duk.ctx);
+        return 1;
+    }, 1, 1) == DUK_EXEC_SUCCESS) {
+        duk_size_t length;
+        void* bytecode = duk_get_buffer(ctx, -1, &length);
+        expected.bytecodeLength = length;
+        expected.bytecodeHash = ofxDuktapeHash(ofxDuktapeHashSeed, bytecode, length);
+        ofBuffer buffer((const char*)&expected, sizeof(expected));
+        buffer.append((const char*)bytecode, length);
+        // written aside and moved into place so a concurrent reader never sees
+        // half a file. every write gets a temp file of its own, as other heaps
+        // and processes may be writing the same entry
+        char suffix[32];
+        snprintf(suffix, sizeof(suffix), ".%08x%08x.tmp", (unsigned)std::random_device()(),
+                 (unsigned)(ofxDuktapeCacheWrites++ ^ std::hash<std::thread::id>()(std::this_thread::get_id())));
+        string temp = path + suffix;
+        if (ofBufferToFile(temp, buffer, true) && !ofFile::moveFromTo(temp, path, false, true)) {
+            ofFile::removeFile(temp, false);
+        }
+    }
+    pop();
+    return 0;
+}
+
+duk_idx_t ofxDuktape::pushHeapStats() {
+    const HeapStats& stats = getHeapStats();
+    duk_idx_t obj = pushObject();
+    putObjectNumbers(obj, {
+        {"liveBytes", (double)stats.liveBytes},
+        {"peakBytes", (double)stats.peakBytes},
+        {"allocCount", (double)stats.allocCount},
+        {"freeCount", (double)stats.freeCount},
+        {"reallocCount", (double)stats.reallocCount},
+    });
+    duk_idx_t sizes = pushArray();
+    for (size_t i = 0; i < ofxDuktapePool::numSizeClasses; i++) {
+        putObjectNumber(sizes, i, ofxDuktapePool::sizeClasses[i]);
+    }
+    freeze(sizes);
+    putPropString(obj, "sizeClasses");
+    duk_idx_t histogram = pushArray();
+    for (size_t i = 0; i <= ofxDuktapePool::numSizeClasses; i++) {
+        putObjectNumber(histogram, i, (double)stats.histogram[i]);
+    }
+    freeze(histogram);
+    putPropString(obj, "histogram");
+    freeze(obj);
+    return obj;
 }
 
 class ofxDuktapeCPPFunctionWrapper {
@@ -108,14 +614,16 @@ static duk_ret_t ofxDuktapeCPPFunctionWrapperFinalizer(duk_context *ctx) {
     return 0;
 }
 
+// fallback used when the native function table is full: the wrapper and
+// context are kept as hidden properties of the function object itself
 static duk_ret_t internal_cpp_function_call(duk_context *ctx) {
     duk_push_current_function(ctx);
     duk_get_prop_string(ctx, -1, ofxDuktapeSpecialFnPtr);
     duk_get_prop_string(ctx, -2, ofxDuktapeSpecialCtxPtr);
     ofxDuktapeCPPFunctionWrapper *wrapper = (ofxDuktapeCPPFunctionWrapper*)duk_get_pointer(ctx, -2);
     ofxDuktape* duk = (ofxDuktape *)duk_get_pointer(ctx, -1);
-    duk_pop(ctx);
-    return wrapper->func(*duk);
+    duk_pop_3(ctx);
+    return wrapper->func(ofxDuktape::forContext(ctx, duk));
 }
 
 static duk_ret_t internal_c_function_call(duk_context *ctx) {
@@ -126,53 +634,337 @@ static duk_ret_t internal_c_function_call(duk_context *ctx) {
     ofxDuktape::c_function fn = (ofxDuktape::c_function)duk_get_pointer(ctx, -3);
     ofxDuktape* context = (ofxDuktape*)duk_get_pointer(ctx, -2);
     void* user = duk_get_pointer(ctx, -1);
-    duk_pop(ctx);
-    return fn(context, user);
+    duk_pop_n(ctx, 4);
+    return fn(&ofxDuktape::forContext(ctx, context), user);
+}
+
+// native functions normally live in a per-heap table, with their slot stored
+// as the function's magic, so a call resolves its target without touching
+// any properties
+struct ofxDuktapeDispatch {
+    static duk_ret_t callCPP(duk_context *ctx) {
+        ofxDuktape::NativeFunction& fn = ofxDuktape::currentNativeFunction(ctx);
+        return fn.func(ofxDuktape::forContext(ctx, fn.duk));
+    }
+    static duk_ret_t callC(duk_context *ctx) {
+        ofxDuktape::NativeFunction& fn = ofxDuktape::currentNativeFunction(ctx);
+        return fn.cfunc(&ofxDuktape::forContext(ctx, fn.duk), fn.userdata);
+    }
+    static duk_ret_t finalize(duk_context *ctx) {
+        duk_memory_functions mem;
+        duk_get_memory_functions(ctx, &mem);
+        ((ofxDuktape*)mem.udata)->releaseNativeFunction((uint16_t)duk_get_magic(ctx, 0));
+        return 0;
+    }
+    // wrappers made for threads are freed along with them, including when the heap is destroyed
+    static duk_ret_t finalizeThread(duk_context *ctx) {
+        duk_context *thread = duk_get_context(ctx, 0);
+        if (!thread) return 0;
+        duk_push_thread_stash(ctx, thread);
+        duk_get_prop_string(ctx, -1, ofxDuktapeProp);
+        ofxDuktape* duk = (ofxDuktape*)duk_get_pointer(ctx, -1);
+        duk_pop(ctx);
+        if (duk) {
+            duk_push_pointer(ctx, NULL);
+            duk_put_prop_string(ctx, -2, ofxDuktapeProp);
+            // listeners get the wrapper pointed at the thread running the
+            // finalizer, as the one being freed may not be usable any more
+            duk->ctx = ctx;
+            ofxDuktape::DestroyEvent ev;
+            ev.duk = duk;
+            ofNotifyEvent(duk->onDestroy, ev);
+            duk->ctx = NULL;
+            delete duk;
+        }
+        duk_pop(ctx);
+        return 0;
+    }
+    static void adoptThread(duk_context *ctx, duk_idx_t index) {
+        index = duk_normalize_index(ctx, index);
+        duk_push_c_function(ctx, finalizeThread, 1);
+        duk_set_finalizer(ctx, index);
+    }
+};
+
+ofxDuktape::NativeFunction& ofxDuktape::currentNativeFunction(duk_context *ctx) {
+    duk_memory_functions mem;
+    duk_get_memory_functions(ctx, &mem);
+    return ((ofxDuktape*)mem.udata)->nativeFunctions[(uint16_t)duk_get_current_magic(ctx)];
+}
+
+ofxDuktape& ofxDuktape::forContext(duk_context *ctx, ofxDuktape* duk) {
+    if (duk->ctx == ctx) return *duk;
+    duk_push_thread_stash(ctx, ctx);
+    duk_get_prop_string(ctx, -1, ofxDuktapeProp);
+    ofxDuktape* found = (ofxDuktape*)duk_get_pointer(ctx, -1);
+    duk_pop_2(ctx);
+    if (!found) {
+        // a thread created from script; wrap it like pushThread() does
+        found = new ofxDuktape(duk->getHeapOwner(), ctx);
+        duk_push_current_thread(ctx);
+        ofxDuktapeDispatch::adoptThread(ctx, -1);
+        duk_pop(ctx);
+    }
+    return *found;
+}
+
+duk_idx_t ofxDuktape::pushThread() {
+    duk_idx_t thread = duk_push_thread(ctx);
+    duk_context *octx = duk_get_context(ctx, thread);
+    pushThreadStash(thread);
+    if(!hasPropString(-1, ofxDuktapeProp)) {
+        new ofxDuktape(getHeapOwner(), octx);
+        ofxDuktapeDispatch::adoptThread(ctx, thread);
+    }
+    pop();
+    return thread;
+}
+
+ofxDuktape& ofxDuktape::acquireThread() {
+    ofxDuktape* owner = getHeapOwner();
+    if (!owner->threadPool.empty()) {
+        ofxDuktape* thread = owner->threadPool.back();
+        owner->threadPool.pop_back();
+        return *thread;
+    }
+    duk_idx_t index = duk_push_thread(ctx);
+    ofxDuktape* thread = new ofxDuktape(owner, duk_get_context(ctx, index));
+    ofxDuktapeDispatch::adoptThread(ctx, index);
+    thread->pooledRef = pinRef(index);
+    pop();
+    return *thread;
+}
+
+void ofxDuktape::releaseThread(ofxDuktape& thread) {
+    ofxDuktape* owner = getHeapOwner();
+    if (thread.pooledRef < 0) {
+        ofLogError("ofxDuktape") << "releaseThread() called with a context that didn't come from acquireThread()";
+        return;
+    }
+    thread.setTop(0);
+    if (owner->threadPool.size() < owner->threadPoolLimit) {
+        owner->threadPool.push_back(&thread);
+    } else {
+        // the thread's finalizer deletes the wrapper once it's unreachable
+        owner->unpinRef(thread.pooledRef);
+    }
+}
+
+void ofxDuktape::setThreadPoolLimit(size_t count) {
+    ofxDuktape* owner = getHeapOwner();
+    owner->threadPoolLimit = count;
+    while (owner->threadPool.size() > count) {
+        ofxDuktape* thread = owner->threadPool.back();
+        owner->threadPool.pop_back();
+        owner->unpinRef(thread->pooledRef);
+    }
+}
+
+size_t ofxDuktape::getPooledThreadCount() {
+    return getHeapOwner()->threadPool.size();
+}
+
+int ofxDuktape::allocNativeFunction() {
+    if (!freeNativeFunctions.empty()) {
+        int slot = freeNativeFunctions.back();
+        freeNativeFunctions.pop_back();
+        return slot;
+    }
+    // the slot has to fit in the 16 bits of a function's magic
+    if (nativeFunctions.size() > 0xffff) return -1;
+    nativeFunctions.push_back(NativeFunction());
+    return nativeFunctions.size() - 1;
+}
+
+void ofxDuktape::releaseNativeFunction(int slot) {
+    nativeFunctions[slot] = NativeFunction();
+    freeNativeFunctions.push_back(slot);
+}
+
+ofxDukTransfer ofxDuktape::detachBuffer(duk_idx_t index) {
+    index = normalizeIndex(index);
+    ofxDukTransfer transfer;
+    if (duk_is_buffer(ctx, index) && duk_is_dynamic_buffer(ctx, index)) {
+        duk_size_t size;
+        void* ptr = duk_steal_buffer(ctx, index, &size);
+        if (ptr) {
+            transfer.block = ofxDuktapeAllocator::adopt(getHeapOwner(), ptr, size);
+            transfer.data = transfer.block ? ptr : NULL;
+            transfer.size = transfer.block ? size : 0;
+        }
+        return transfer;
+    }
+    if (isObject(index)) {
+        // memory attached by pushTransfer(), found on the ArrayBuffer itself or behind a view
+        dup(index);
+        if (!hasPropString(-1, ofxDukTransferBlock)) {
+            getPropString(-1, "buffer");
+            duk_remove(ctx, -2);
+        }
+        void* block = NULL;
+        if (isObject(-1)) {
+            getPropString(-1, ofxDukTransferBlock);
+            block = getPointer(-1);
+            pop();
+        }
+        if (block) {
+            getPropString(-1, ofxDukTransferBuffer);
+            duk_size_t size;
+            void* data = duk_get_buffer(ctx, -1, &size);
+            duk_config_buffer(ctx, -1, NULL, 0);
+            pop();
+            // the memory is ours now, not the finalizer's
+            putObjectPointer(-1, ofxDukTransferBlock, NULL);
+            pop();
+            transfer.block = block;
+            transfer.data = data;
+            transfer.size = size;
+            return transfer;
+        }
+        pop();
+    }
+    duk_size_t size;
+    void* data = duk_get_buffer_data(ctx, index, &size);
+    if (data) {
+        transfer = ofxDukTransfer(size);
+        if (transfer) memcpy(transfer.data, data, size);
+    }
+    return transfer;
+}
+
+duk_idx_t ofxDuktape::pushTransfer(ofxDukTransfer&& transfer) {
+    pushExternalBuffer(transfer.data, transfer.size);
+    pushBufferObject(-1, 0, transfer.size, DUK_BUFOBJ_ARRAYBUFFER);
+    swap(-1, -2);
+    putPropString(-2, ofxDukTransferBuffer);
+    putObjectPointer(-1, ofxDukTransferBlock, transfer.block);
+    duk_push_c_function(ctx, ofxDuktapeTransferFinalizer, 1);
+    duk_set_finalizer(ctx, -2);
+    transfer.block = transfer.data = NULL;
+    transfer.size = 0;
+    return normalizeIndex(-1);
+}
+
+int ofxDuktape::pinRef(duk_idx_t index) {
+    index = normalizeIndex(index);
+    ofxDuktape* owner = getHeapOwner();
+    if (!owner->refStash) {
+        pushHeapStash();
+        pushArray();
+        owner->refStash = getHeapPtr(-1);
+        putPropString(-2, DUK_HIDDEN_SYMBOL("ofxDukRefs"));
+        pop();
+    }
+    int slot;
+    if (!owner->freeRefSlots.empty()) {
+        slot = owner->freeRefSlots.back();
+        owner->freeRefSlots.pop_back();
+    } else {
+        pushHeapPtr(owner->refStash);
+        slot = getLength(-1);
+        pop();
+    }
+    pushHeapPtr(owner->refStash);
+    dup(index);
+    putPropIndex(-2, slot);
+    pop();
+    return slot;
+}
+
+void ofxDuktape::unpinRef(int slot) {
+    ofxDuktape* owner = getHeapOwner();
+    pushHeapPtr(owner->refStash);
+    pushUndefined();
+    putPropIndex(-2, slot);
+    pop();
+    owner->freeRefSlots.push_back(slot);
+}
+
+void ofxDuktape::pushRef(int slot) {
+    pushHeapPtr(getHeapOwner()->refStash);
+    getPropIndex(-1, slot);
+    duk_remove(ctx, -2);
+}
+
+void* ofxDuktape::getKeyPtr(const ofxDukKey& key) {
+    ofxDuktape* owner = getHeapOwner();
+    int id = key.getId();
+    if (id >= (int)owner->internedKeys.size()) {
+        owner->internedKeys.resize(id + 1, NULL);
+    }
+    void*& ptr = owner->internedKeys[id];
+    if (!ptr) {
+        // pinned so the string stays interned (and the pointer valid) until the heap goes away
+        pushString(key.getName());
+        ptr = getHeapPtr(-1);
+        pinRef(-1);
+        pop();
+    }
+    return ptr;
+}
+
+bool ofxDuktape::pushTypedFunction(duk_c_function trampoline, void (*func)(), int arguments) {
+    ofxDuktape* owner = getHeapOwner();
+    int slot = owner->allocNativeFunction();
+    if (slot < 0) return false;
+    NativeFunction& fn = owner->nativeFunctions[slot];
+    fn.typed = func;
+    fn.duk = owner;
+    duk_push_c_function(ctx, trampoline, arguments);
+    duk_set_magic(ctx, -1, (int16_t)slot);
+    duk_push_c_function(ctx, ofxDuktapeDispatch::finalize, 1);
+    duk_set_finalizer(ctx, -2);
+    return true;
 }
 
 void ofxDuktape::pushCFunction(c_function func, int arguments, void* userdata) {
+    ofxDuktape* owner = getHeapOwner();
+    int slot = owner->allocNativeFunction();
+    if (slot >= 0) {
+        NativeFunction& fn = owner->nativeFunctions[slot];
+        fn.cfunc = func;
+        fn.duk = owner;
+        fn.userdata = userdata;
+        duk_push_c_function(ctx, ofxDuktapeDispatch::callC, arguments);
+        duk_set_magic(ctx, -1, (int16_t)slot);
+        duk_push_c_function(ctx, ofxDuktapeDispatch::finalize, 1);
+        duk_set_finalizer(ctx, -2);
+        return;
+    }
     duk_push_c_function(ctx, internal_c_function_call, arguments);
     duk_push_pointer(ctx, (void*)func);
     duk_put_prop_string(ctx, -2, ofxDuktapeSpecialFnPtr);
-    //duk_pop(ctx);
-    duk_push_pointer(ctx, (void*)this);
+    duk_push_pointer(ctx, (void*)owner);
     duk_put_prop_string(ctx, -2, ofxDuktapeSpecialCtxPtr);
-    //duk_pop(ctx);
     duk_push_pointer(ctx, userdata);
     duk_put_prop_string(ctx, -2, ofxDuktapeSpecialUserPtr);
-    duk_pop(ctx);
 }
 
 void ofxDuktape::pushFunction(cpp_function func, int arguments) {
+    ofxDuktape* owner = getHeapOwner();
+    int slot = owner->allocNativeFunction();
+    if (slot >= 0) {
+        NativeFunction& fn = owner->nativeFunctions[slot];
+        fn.func = func;
+        fn.duk = owner;
+        duk_push_c_function(ctx, ofxDuktapeDispatch::callCPP, arguments);
+        duk_set_magic(ctx, -1, (int16_t)slot);
+        duk_push_c_function(ctx, ofxDuktapeDispatch::finalize, 1);
+        duk_set_finalizer(ctx, -2);
+        return;
+    }
     duk_push_c_function(ctx, internal_cpp_function_call, arguments);
     ofxDuktapeCPPFunctionWrapper *wrapper = new ofxDuktapeCPPFunctionWrapper(func);
     duk_push_pointer(ctx, (void*)wrapper);
     duk_put_prop_string(ctx, -2, ofxDuktapeSpecialFnPtr);
     //duk_pop(ctx);
-    duk_push_pointer(ctx, (void*)this);
+    duk_push_pointer(ctx, (void*)owner);
     duk_put_prop_string(ctx, -2, ofxDuktapeSpecialCtxPtr);
     //duk_pop(ctx);
     duk_push_c_function(ctx, ofxDuktapeCPPFunctionWrapperFinalizer, 1);
     duk_set_finalizer(ctx, -2);
 }
 
-static duk_ret_t ofxDuktapeSafeCallFunc(duk_context *ctx, void * udata) {
-    if(duk_get_global_string(ctx, ofxDuktapeProp)) {
-        ofxDuktape *duk = (ofxDuktape*)duk_get_pointer(ctx, -1);
-        ofxDuktapeCPPFunctionWrapper *wrapper = (ofxDuktapeCPPFunctionWrapper *)duk_get_pointer(ctx, -1);
-        if(wrapper) {
-            return wrapper->func(*duk);
-        }
-    }
-    return -1;
-}
-
-duk_ret_t ofxDuktape::safeCall(cpp_function func, int arguments, int rets) {
-    shared_ptr<ofxDuktapeCPPFunctionWrapper> wrapper = make_shared<ofxDuktapeCPPFunctionWrapper>(func);
-    duk_push_pointer(ctx, wrapper.get());
-    return duk_safe_call(ctx, ofxDuktapeSafeCallFunc, NULL, arguments+1, rets);
-}
-
 static duk_size_t ofxDuktapeDebugReadCB(void* data, char* buffer, duk_size_t length) {
     ofxDuktape::ReadEvent ev;
     ev.duk = (ofxDuktape*)data;
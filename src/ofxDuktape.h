@@ -12,6 +12,33 @@
 #include "duktape.h"
 #include <initializer_list>
 #include <tuple>
+#include <deque>
+#include <limits>
+#include "ofxDuktapePool.h"
+#include "ofxDuktapePostQueue.h"
+
+// converts values between the Duktape stack and C++ for typed bindings;
+// specialize it to bind functions taking or returning other types
+template<typename T, typename Enable = void> struct ofxDuktapeType;
+
+class ofxDukRef;
+class ofxDukTransfer;
+
+// a property name declared once (usually as a static) and interned lazily in
+// each heap it gets used with, so hot property accesses skip string interning
+class ofxDukKey {
+public:
+    explicit ofxDukKey(const string& name): name(name), id(registerKey()) {}
+    inline const string& getName() const { return name; }
+    inline int getId() const { return id; }
+protected:
+    string name;
+    int id;
+    static int registerKey() {
+        static atomic<int> count(0);
+        return count++;
+    }
+};
 
 class ofxDuktape {
 public:
@@ -21,20 +48,251 @@ public:
         int code;
         string description;
     };
+    // how the heap gets its memory: straight from malloc/realloc/free,
+    // or from per-heap size-classed pools (with malloc for large blocks)
+    enum AllocatorMode {
+        ALLOCATOR_MALLOC,
+        ALLOCATOR_POOL,
+    };
+    // a C/C++ function pushed into the heap, looked up by the magic of the
+    // Duktape function wrapping it
+    struct NativeFunction {
+        cpp_function func;
+        c_function cfunc;
+        void (*typed)();
+        // the heap owner, which lives as long as the function. calls find the
+        // wrapper of the thread they run on through it
+        ofxDuktape* duk;
+        void* userdata;
+        NativeFunction(): cfunc(NULL), typed(NULL), duk(NULL), userdata(NULL) {}
+    };
+    // memory usage of a heap, as seen by its allocator hooks
+    struct HeapStats {
+        size_t liveBytes;
+        size_t peakBytes;
+        uint64_t allocCount;
+        uint64_t freeCount;
+        uint64_t reallocCount;
+        // allocations per pool size class, plus a last bucket for larger blocks
+        uint64_t histogram[ofxDuktapePool::numSizeClasses + 1];
+    };
+    // collections the addon ran (gc() and collectIfDue()) and how long they paused
+    // the heap. Duktape's own voluntary and emergency collections aren't counted
+    struct GCStats {
+        uint64_t collections;
+        // run by collectIfDue() rather than gc()
+        uint64_t triggered;
+        // run by collectIfDue() while deferred, after running past the deferral cap
+        uint64_t overdue;
+        uint64_t lastPauseMicros;
+        uint64_t maxPauseMicros;
+        uint64_t totalPauseMicros;
+    };
+    // sent as an ofxDuktape is destroyed, while its heap can still be used
+    struct DestroyEvent {
+        ofxDuktape *duk;
+    };
+    // sent when the allocator refuses to grow the heap past its memory limit
+    struct MemoryLimitEvent {
+        ofxDuktape *duk;
+        size_t requested;
+        size_t liveBytes;
+        size_t limit;
+    };
 protected:
+    friend struct ofxDuktapeAllocator;
+    friend struct ofxDuktapeDispatch;
+    friend class ofxDukRef;
+    friend struct ofxDuktapeBudgetScope;
+    friend duk_bool_t ::ofxDuktapeExecTimeoutCheck(void *udata);
     duk_context* ctx;
+    AllocatorMode allocatorMode;
+    ofxDuktapePool* pool;
+    HeapStats heapStats;
+    size_t memoryLimit;
+    size_t memoryLimitRefused;
+    int memoryLimitRefusals;
+    // refusals recorded by the allocator, waiting for the failing call to return
+    vector<MemoryLimitEvent> memoryLimitEvents;
+    void notifyMemoryLimit();
+    inline int deliverMemoryLimit(int ret) {
+        ofxDuktape* owner = getHeapOwner();
+        if (!owner->memoryLimitEvents.empty()) owner->notifyMemoryLimit();
+        return ret;
+    }
+    // collection pacing (heap owner only). the next collection is due once
+    // allocCount reaches gcTriggerAllocs, gcSpan allocations after the last one
+    uint64_t gcTriggerAllocs;
+    uint64_t gcSpan;
+    int gcDeferred;
+    GCStats gcStats;
+    void finishCollection(uint64_t micros, bool triggered);
+    void createHeap(AllocatorMode mode);
+    // native function table, only used on the heap owner. a deque keeps
+    // entries in place while functions pushed from inside a call grow it
+    deque<NativeFunction> nativeFunctions;
+    vector<uint16_t> freeNativeFunctions;
+    int allocNativeFunction();
+    void releaseNativeFunction(int slot);
+    // array in the heap stash holding values pinned by ofxDukRef, only used on the heap owner
+    void* refStash;
+    vector<int> freeRefSlots;
+    int pinRef(duk_idx_t index);
+    void unpinRef(int slot);
+    void pushRef(int slot);
+    // interned key strings by ofxDukKey id, pinned for the lifetime of the heap (heap owner only)
+    vector<void*> internedKeys;
+    // directory compiled functions are cached in (heap owner only, empty when disabled)
+    string compileCacheDirectory;
+    int pCompileCached(const string* filename, const string& s, unsigned int flags);
+    // execution budget (heap owner only), checked from Duktape's interrupt every
+    // interruptInterval instructions. limits are absolute, 0 meaning no limit
+    struct ExecutionBudget {
+        uint64_t deadline;          // in ofGetElapsedTimeMicros() time
+        uint64_t interruptLimit;    // in interruptCount
+        bool exceeded;
+    };
+    ExecutionBudget budget;
+    uint64_t interruptCount;
+    bool checkExecutionBudget();
+    ExecutionBudget makeBudget(uint64_t microseconds, uint64_t instructions);
+    // calls posted from other threads (heap owner only)
+    ofxDuktapePostQueue postQueue;
+    // idle threads handed out by acquireThread() (heap owner only)
+    vector<ofxDuktape*> threadPool;
+    size_t threadPoolLimit;
+    // ref slot keeping a pooled thread alive, -1 for other contexts
+    int pooledRef;
+    // gets the table entry for the native function currently being called
+    static NativeFunction& currentNativeFunction(duk_context *ctx);
+    
+    // compile-time argument index lists for typed bindings
+    template<size_t... I> struct indices {};
+    template<size_t N, size_t... I> struct make_indices: make_indices<N - 1, N - 1, I...> {};
+    template<size_t... I> struct make_indices<0, I...> { typedef indices<I...> type; };
+    
+    template<typename R, typename... Args, size_t... I>
+    static inline duk_ret_t invokeTyped(ofxDuktape& duk, R (*fn)(Args...), indices<I...>, std::false_type) {
+        ofxDuktapeType<typename std::decay<R>::type>::push(duk, fn(ofxDuktapeType<typename std::decay<Args>::type>::get(duk, I)...));
+        return 1;
+    }
+    template<typename R, typename... Args, size_t... I>
+    static inline duk_ret_t invokeTyped(ofxDuktape& duk, R (*fn)(Args...), indices<I...>, std::true_type) {
+        fn(ofxDuktapeType<typename std::decay<Args>::type>::get(duk, I)...);
+        return 0;
+    }
+    // one trampoline per signature; the function pointer comes from the native function table
+    template<typename R, typename... Args>
+    static duk_ret_t typedTrampoline(duk_context *ctx) {
+        NativeFunction& fn = currentNativeFunction(ctx);
+        return invokeTyped(forContext(ctx, fn.duk), (R (*)(Args...))fn.typed,
+                           typename make_indices<sizeof...(Args)>::type(),
+                           typename std::is_void<R>::type());
+    }
+    // pushes a trampoline bound to a plain function pointer, returning false if the table is full
+    bool pushTypedFunction(duk_c_function trampoline, void (*fn)(), int arguments);
+    
+    template<typename F>
+    struct SafeCallData {
+        ofxDuktape* duk;
+        F* func;
+    };
+    template<typename F>
+    static duk_ret_t safeCallTrampoline(duk_context *ctx, void* udata) {
+        SafeCallData<F>* data = (SafeCallData<F>*)udata;
+        return (*data->func)(*data->duk);
+    }
 public:
-    ofxDuktape();
+    ofxDuktape(AllocatorMode mode = ALLOCATOR_MALLOC);
     // constructs an object as a thread of the first
     ofxDuktape(ofxDuktape *parent, bool newenv=false);
     ofxDuktape(ofxDuktape *parent, duk_context *other_ctx);
     virtual ~ofxDuktape();
     ofEvent<ErrorData> onFatalError;
+    // also sent for the wrappers of threads the addon frees (pushThread(),
+    // acquireThread() and threads created from script) when their thread is
+    // collected, possibly from a pool thread. listeners must leave the stack as
+    // they found it
+    ofEvent<DestroyEvent> onDestroy;
+    // notified once per refused request, after the protected call (pCall, pEval*,
+    // pCompile*, safeCall) it happened in returns
+    ofEvent<MemoryLimitEvent> onMemoryLimit;
     
     void threadSetup();
     
-    // triggers a round of garbage collection
-    inline void gc() { duk_gc(ctx, 0); }
+    inline AllocatorMode getAllocatorMode() { return allocatorMode; }
+    // gets the ofxDuktape that created the heap (and owns its allocator state);
+    // contexts with the same owner can't run at the same time
+    ofxDuktape* getHeapOwner();
+    // gets the pool backing this heap (NULL unless created with ALLOCATOR_POOL)
+    inline ofxDuktapePool* getPool() { return pool; }
+    // gets the memory statistics for the heap this context belongs to
+    const HeapStats& getHeapStats();
+    // pushes a frozen snapshot of getHeapStats() as an object
+    duk_idx_t pushHeapStats();
+    
+    // caps the live bytes of the heap (0 disables the limit). allocations past
+    // the limit are refused, which makes Duktape run an emergency collection and
+    // retry before throwing an "alloc failed" error the script can catch
+    void setMemoryLimit(size_t bytes);
+    size_t getMemoryLimit();
+    
+    // caches functions compiled through pCompileString/pCompileStringFilename as
+    // bytecode in a directory, keyed by source hash and Duktape version, and
+    // loads them back instead of reparsing. only point this at a directory the
+    // app controls - bytecode is not validated by Duktape. relative paths are in
+    // the data folder, empty disables it
+    void setCompileCacheDirectory(const string& directory);
+    string getCompileCacheDirectory();
+    
+    // bytecode instructions run between budget checks
+    static const uint64_t interruptInterval = 256 * 1024;
+    // puts everything the heap runs from now until clearExecutionBudget() under a
+    // budget of wall-clock microseconds and/or bytecode instructions (0 is no limit).
+    // when it runs out the script gets a RangeError "execution timeout", rethrown
+    // at every check until control is back in C++. checks happen every
+    // interruptInterval instructions, so instruction budgets are rounded up to that
+    void setExecutionBudget(uint64_t microseconds, uint64_t instructions = 0);
+    void clearExecutionBudget();
+    // whether the current budget ran out
+    bool isExecutionBudgetExceeded();
+    // protected calls under their own budget; an enclosing budget still applies
+    int pCallBudgeted(int num_arguments, uint64_t microseconds, uint64_t instructions = 0);
+    int pEvalStringBudgeted(const string& s, uint64_t microseconds, uint64_t instructions = 0);
+    
+    typedef ofxDuktapePostQueue::post_function post_function;
+    // queues fn to run on the heap's own thread at the next runPosted(). can be
+    // called from any thread without blocking, as long as the heap outlives the call
+    void post(post_function fn);
+    // queues a CBOR-encoded value; fn runs with the decoded value on top of the stack
+    void post(const string& cbor, post_function fn);
+    // runs the calls posted before it started, in order, and returns how many
+    // ran. script errors are logged. ofxDukBindings calls it at the start of every update
+    size_t runPosted();
+    
+    // triggers a round of garbage collection. Duktape skips it while it can't
+    // collect (e.g. from inside a finalizer), so don't call it from there
+    void gc();
+    
+    // collections are paced on the allocator hooks' counts: one is due once the
+    // allocations since the last one reach gcTriggerRatio times the live ones (at
+    // least gcMinAllocs), and collectIfDue() runs it. ofxDukBindings calls that
+    // every frame. while deferred, it waits until gcDeferLimit times as far, so a
+    // long deferral can't grow the heap without bound
+    static const uint64_t gcTriggerRatio = 25;
+    static const uint64_t gcMinAllocs = 1024;
+    static const uint64_t gcDeferLimit = 4;
+    // collects if a collection is due, returning whether it did. only call it
+    // where gc() is allowed
+    bool collectIfDue();
+    // makes collectIfDue() wait until the matching endGCDeferral(); nests
+    void beginGCDeferral();
+    void endGCDeferral();
+    bool isGCDeferred();
+    // how far the heap is towards its next due collection: 0 right after one,
+    // 1 when due (past 1 while deferred, or until collectIfDue() runs)
+    double getGCDebt();
+    const GCStats& getGCStats();
     
     // pops (ignores) the topmost argument in the stack
     inline void pop() { duk_pop(ctx); }
@@ -77,6 +335,8 @@ public:
     // moves the argument at the top of the stack to the position indicated,
     // shifting all arguments at index and after upwards.
     inline void insert(duk_idx_t index) { duk_insert(ctx, index); }
+    // removes the argument at index, shifting the ones above it down
+    inline void remove(duk_idx_t index) { duk_remove(ctx, index); }
     // joins a given amount of values into a result string with a separator between each value
     inline void join(duk_idx_t count) { duk_join(ctx, count); }
     // removes white-space characters from both ends of the string at index
@@ -264,12 +524,25 @@ public:
     }
     // pushes a new target (if within a constructor call - else pushes undefined)
     inline void pushNewTarget() { duk_push_new_target(ctx); }
+    // pushes a new error object (DUK_ERR_ERROR, DUK_ERR_TYPE_ERROR, ...) without throwing it
+    inline duk_idx_t pushError(duk_errcode_t code, const string& message) {
+        return duk_push_error_object(ctx, code, "%s", message.c_str());
+    }
 
     // steals a buffer from the stack, allowing the application
     // to manage that chunk of memory
     inline void* stealBuffer(duk_idx_t index, size_t& out_size) {
         return duk_steal_buffer(ctx, index, &out_size);
     }
+    // detaches the memory of the buffer at index so another heap can take it
+    // over without copying. dynamic buffers are stolen (left empty), and
+    // ArrayBuffers, typed arrays and Node.js Buffers over memory attached with
+    // pushTransfer() are neutered (left with zero length). anything else - like
+    // the fixed buffers new ArrayBuffer() creates - is copied and left as is
+    ofxDukTransfer detachBuffer(duk_idx_t index);
+    // pushes an ArrayBuffer over the memory of a transfer, freed once the
+    // ArrayBuffer is collected
+    duk_idx_t pushTransfer(ofxDukTransfer&& transfer);
     // pushes a buffer object or a buffer view object, with data from the buffer object
     inline void pushBufferObject(duk_idx_t buf, duk_size_t offset, duk_size_t byte_length, duk_uint_t flags) {
         duk_push_buffer_object(ctx, buf, offset, byte_length, flags);
@@ -280,6 +553,23 @@ public:
     // pushes a C++ function (with a single argument)
     void pushFunction(cpp_function func, int arguments);
     
+    // pushes a plain C++ function, with argument and return value conversions
+    // generated at compile time (see ofxDuktapeType)
+    template<typename R, typename... Args>
+    void pushFunction(R (*fn)(Args...)) {
+        if (!pushTypedFunction(&ofxDuktape::typedTrampoline<R, Args...>, (void (*)())fn, sizeof...(Args))) {
+            // native function table is full; go through the generic wrapper instead
+            pushFunction([fn](ofxDuktape& duk) {
+                return invokeTyped(duk, fn, typename make_indices<sizeof...(Args)>::type(),
+                                   typename std::is_void<R>::type());
+            }, sizeof...(Args));
+        }
+    }
+    // like pushFunction(fn), picking one overload by its signature:
+    // duk.bind<void(float, float, float, float)>(&ofDrawLine)
+    template<typename Sig>
+    inline void bind(Sig* fn) { pushFunction(fn); }
+    
     // pushes a pointer to an in-heap object into the top of the stack
     inline void pushHeapPtr(void* ptr) {
         duk_push_heapptr(ctx, ptr);
@@ -296,6 +586,20 @@ public:
     
     // pushes a new thread (along with an ofxDuktape context)
     duk_idx_t pushThread();
+    // gets the ofxDuktape for a thread of the same heap as duk, wrapping it if
+    // needed. native functions get called with this, as a function called from
+    // a coroutine runs on its thread, not the one that pushed it. pass the heap
+    // owner rather than a thread wrapper that might be gone by the time of the call
+    static ofxDuktape& forContext(duk_context *ctx, ofxDuktape* duk);
+    // borrows a thread of the heap with an empty stack of its own. threads come
+    // from a per-heap pool instead of being created every time; give it back
+    // with releaseThread(), or borrow it through an ofxDukThread. only for
+    // calls, as a thread resumed as a coroutine can't be reused once it finishes
+    ofxDuktape& acquireThread();
+    void releaseThread(ofxDuktape& thread);
+    // idle threads the pool keeps (16 by default); released threads past that are freed
+    void setThreadPoolLimit(size_t count);
+    size_t getPooledThreadCount();
 
     // pushes the current running thread to the stack
     inline void pushCurrentThread() { duk_push_current_thread(ctx); }
@@ -331,7 +635,15 @@ public:
     inline string safeToStacktrace(duk_idx_t index) { return duk_safe_to_stacktrace(ctx, index); }
     inline const char* safeToStacktraceC(duk_idx_t index) { return duk_safe_to_stacktrace(ctx, index); }
     
-    inline duk_ret_t safeCall(cpp_function func, int arguments, int rets);
+    // calls func(*this) in protected mode, taking the topmost arguments from the stack
+    // and leaving rets values in their place; returns DUK_EXEC_SUCCESS or DUK_EXEC_ERROR.
+    // the callable is passed by reference through duk_safe_call's udata, so nothing is allocated
+    template<typename F>
+    inline duk_ret_t safeCall(F&& func, int arguments, int rets) {
+        SafeCallData<typename std::remove_reference<F>::type> data = { this, &func };
+        return deliverMemoryLimit(duk_safe_call(ctx, &ofxDuktape::safeCallTrampoline<typename std::remove_reference<F>::type>,
+                                                &data, arguments, rets));
+    }
     
     // sets an argument into null
     inline void toNull(duk_idx_t index) { duk_to_null(ctx, index); }
@@ -491,6 +803,9 @@ public:
     inline bool getProperty(duk_idx_t obj_index, const string& key) {
         return duk_get_prop_string(ctx, obj_index, key.c_str());
     }
+    inline bool getProperty(duk_idx_t obj_index, const ofxDukKey& key) {
+        return duk_get_prop_heapptr(ctx, obj_index, getKeyPtr(key));
+    }
 
     inline void getPrototype(duk_idx_t obj_index) { duk_get_prototype(ctx, obj_index); }
     inline bool hasProp(duk_idx_t obj_index) {
@@ -506,6 +821,9 @@ public:
     inline bool hasProperty(duk_idx_t obj_index, const string& key) {
         return duk_has_prop_string(ctx, obj_index, key.c_str());
     }
+    inline bool hasProperty(duk_idx_t obj_index, const ofxDukKey& key) {
+        return duk_has_prop_heapptr(ctx, obj_index, getKeyPtr(key));
+    }
     inline bool hasPropIndex(duk_idx_t obj_index, int prop_index) {
         return duk_has_prop_index(ctx, obj_index, prop_index);
     }
@@ -547,6 +865,12 @@ public:
     inline bool putProperty(duk_idx_t obj_index, const string& key) {
         return duk_put_prop_string(ctx, obj_index, key.c_str());
     }
+    inline bool putProperty(duk_idx_t obj_index, const ofxDukKey& key) {
+        return duk_put_prop_heapptr(ctx, obj_index, getKeyPtr(key));
+    }
+    
+    // gets the interned string for a key in this heap, interning it on first use
+    void* getKeyPtr(const ofxDukKey& key);
     
     inline void putGlobalString(const string& s) { duk_put_global_string(ctx, s.c_str()); }
     inline bool getGlobalString(const string& key) {
@@ -877,28 +1201,30 @@ public:
     }
     
     inline int pCall(int num_arguments) {
-        return duk_pcall(ctx, num_arguments);
+        return deliverMemoryLimit(duk_pcall(ctx, num_arguments));
     }
     inline int pCallMethod(int num_arguments) {
-        return duk_pcall_method(ctx, num_arguments);
+        return deliverMemoryLimit(duk_pcall_method(ctx, num_arguments));
     }
     inline int pCallProp(int obj_index, int num_arguments) {
-        return duk_pcall_prop(ctx, obj_index, num_arguments);
+        return deliverMemoryLimit(duk_pcall_prop(ctx, obj_index, num_arguments));
     }
     inline int pCompile(unsigned int flags) {
-        return duk_pcompile(ctx, flags);
+        return deliverMemoryLimit(duk_pcompile(ctx, flags));
     }
     inline int pCompileString(const string& s, unsigned int flags) {
-        return duk_pcompile_lstring(ctx, flags, s.c_str(), s.length());
+        if (!getHeapOwner()->compileCacheDirectory.empty()) return deliverMemoryLimit(pCompileCached(NULL, s, flags));
+        return deliverMemoryLimit(duk_pcompile_lstring(ctx, flags, s.c_str(), s.length()));
     }
     int pCompileStringFilename(const string& filename, string s, unsigned int flags) {
+        if (!getHeapOwner()->compileCacheDirectory.empty()) return deliverMemoryLimit(pCompileCached(&filename, s, flags));
         pushString(filename);
-        return duk_pcompile_lstring_filename(ctx, flags, s.c_str(), s.length());
+        return deliverMemoryLimit(duk_pcompile_lstring_filename(ctx, flags, s.c_str(), s.length()));
     }
-    inline int pEval() { return duk_peval(ctx); }
-    inline int pEvalNoResult() { return duk_peval_noresult(ctx); }
+    inline int pEval() { return deliverMemoryLimit(duk_peval(ctx)); }
+    inline int pEvalNoResult() { return deliverMemoryLimit(duk_peval_noresult(ctx)); }
     inline int pEvalString(const string& s)  {
-        return duk_peval_lstring(ctx, s.c_str(), s.length());
+        return deliverMemoryLimit(duk_peval_lstring(ctx, s.c_str(), s.length()));
     }
     
     class InvalidKeyException {
@@ -969,6 +1295,10 @@ public:
         if(getPropIndex(obj, index)) return getBool(-1);
         throw(InvalidIndexException(this, index, "not found in object"));
     }
+    inline bool getObjectBool(duk_idx_t obj, const ofxDukKey& key) {
+        if (getProperty(obj, key)) return getBool(-1);
+        throw(InvalidKeyException(this, key.getName(), "not found in object"));
+    }
     
     
     inline int getObjectInt(duk_idx_t obj, const string& key) {
@@ -979,6 +1309,10 @@ public:
         if(getPropIndex(obj, index)) return getInt(-1);
         throw(InvalidIndexException(this, index, "not found in object"));
     }
+    inline int getObjectInt(duk_idx_t obj, const ofxDukKey& key) {
+        if (getProperty(obj, key)) return getInt(-1);
+        throw(InvalidKeyException(this, key.getName(), "not found in object"));
+    }
     
     inline double getObjectNumber(duk_idx_t obj, const string& key) {
         if (getPropString(obj, key)) return getNumber(-1);
@@ -988,6 +1322,10 @@ public:
         if(getPropIndex(obj, index)) return getNumber(-1);
         throw(InvalidIndexException(this, index, "not found in object"));
     }
+    inline double getObjectNumber(duk_idx_t obj, const ofxDukKey& key) {
+        if (getProperty(obj, key)) return getNumber(-1);
+        throw(InvalidKeyException(this, key.getName(), "not found in object"));
+    }
 
     inline string getObjectString(duk_idx_t obj, const string& key) {
         if (getPropString(obj, key)) return getString(-1);
@@ -997,6 +1335,10 @@ public:
         if (getPropIndex(obj, index)) return getString(-1);
         throw(InvalidIndexException(this, index, "not found in object"));
     }
+    inline string getObjectString(duk_idx_t obj, const ofxDukKey& key) {
+        if (getProperty(obj, key)) return getString(-1);
+        throw(InvalidKeyException(this, key.getName(), "not found in object"));
+    }
     
     inline string getObjectSafeString(duk_idx_t obj, const string& key) {
         if (getPropString(obj, key)) return safeToString(-1);
@@ -1044,6 +1386,10 @@ public:
         if (getPropIndex(obj, index)) return normalizeIndex(-1);
         throw(InvalidIndexException(this, index, "not found in object"));
     }
+    inline duk_idx_t getObjectObject(duk_idx_t obj, const ofxDukKey& key) {
+        if (getProperty(obj, key)) return normalizeIndex(-1);
+        throw(InvalidKeyException(this, key.getName(), "not found in object"));
+    }
     
     inline bool isObjectPropUndefined(duk_idx_t obj, const string& key) {
         if (getPropString(obj, key)) return isUndefined(-1);
@@ -1198,14 +1544,14 @@ public:
     
     inline void putObjectNull(duk_idx_t obj, const string& key) {
         pushNull();
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectNull(duk_idx_t obj, duk_idx_t i) {
         pushNull();
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
@@ -1213,222 +1559,271 @@ public:
     
     inline void putObjectUndefined(duk_idx_t obj, const string& key) {
         pushUndefined();
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectUndefined(duk_idx_t obj, duk_idx_t i) {
         pushUndefined();
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectTrue(duk_idx_t obj, const string& key) {
         pushTrue();
-        if (!putProperty(obj >0?obj:obj - 1, key)) {
+        if (!putProperty(obj >=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectTrue(duk_idx_t obj, duk_idx_t i) {
         pushTrue();
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFalse(duk_idx_t obj, const string& key) {
         pushFalse();
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFalse(duk_idx_t obj, duk_idx_t i) {
         pushFalse();
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectBool(duk_idx_t obj, const string&key, bool b) {
         pushBool(b);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectBool(duk_idx_t obj, duk_idx_t i, bool b) {
         pushBool(b);
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    
+    inline void putObjectBool(duk_idx_t obj, const ofxDukKey& key, bool v) {
+        pushBool(v);
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectInt(duk_idx_t obj, const string&key, int i) {
         pushInt(i);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectInt(duk_idx_t obj, duk_idx_t i, int n) {
         pushInt(n);
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    
+    inline void putObjectInt(duk_idx_t obj, const ofxDukKey& key, int v) {
+        pushInt(v);
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     inline void putObjectUint(duk_idx_t obj, const string&key, unsigned int i) {
         pushUint(i);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectUint(duk_idx_t obj, duk_idx_t i, unsigned int n) {
         pushUint(n);
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    
+    inline void putObjectUint(duk_idx_t obj, const ofxDukKey& key, unsigned int v) {
+        pushUint(v);
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectNumber(duk_idx_t obj, const string&key, double d) {
         pushNumber(d);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectNumber(duk_idx_t obj, duk_idx_t i, double d) {
         pushNumber(d);
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    
+    inline void putObjectNumber(duk_idx_t obj, const ofxDukKey& key, double v) {
+        pushNumber(v);
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectString(duk_idx_t obj, const string&key, const string& value) {
         pushString(value);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectString(duk_idx_t obj, duk_idx_t i, const string& value) {
         pushString(value);
-        if (!putProperty(obj > 0?obj:obj - 1, i)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, i)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    
+    inline void putObjectString(duk_idx_t obj, const ofxDukKey& key, const string& v) {
+        pushString(v);
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectPointer(duk_idx_t obj, const string&key, void* ptr) {
         pushPointer(ptr);
-        if (!putProperty(obj > 0?obj:obj - 1, key)) {
+        if (!putProperty(obj >= 0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
 
     inline void putObjectHeapPtr(duk_idx_t obj, const string& key, void* ptr) {
         pushHeapPtr(ptr);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectHeapPtr(duk_idx_t obj, duk_idx_t i, void* ptr) {
         pushHeapPtr(ptr);
-        if (!putProperty(obj>0?obj:obj - 1, i)) {
+        if (!putProperty(obj>=0?obj:obj - 1, i)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFunction(duk_idx_t obj, const string& key, cpp_function func, int args) {
         pushFunction(func, args);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     inline void putObjectFunction(duk_idx_t obj, const char* key, cpp_function func, int args) {
         pushFunction(func, args);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFunction(duk_idx_t obj, duk_idx_t key, cpp_function func, int args) {
         pushFunction(func, args);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
+    template<typename R, typename... Args>
+    inline void putObjectFunction(duk_idx_t obj, const string& key, R (*fn)(Args...)) {
+        pushFunction(fn);
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
+            throw(InvalidObjectException(this, obj, "invalid object"));
+        }
+    }
+    // puts one overload of a function, chosen by its signature:
+    // duk.putObjectBinding<void(float)>(of, "drawAxis", &ofDrawAxis)
+    template<typename Sig>
+    inline void putObjectBinding(duk_idx_t obj, const string& key, Sig* fn) {
+        putObjectFunction(obj, key, fn);
+    }
+    
     inline void putObjectDynamicBuffer(duk_idx_t obj, const string& key, int initial_size, void** bufptr) {
         *bufptr = pushDynamicBuffer(initial_size);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectDynamicBuffer(duk_idx_t obj, duk_idx_t key, int initial_size, void** bufptr) {
         *bufptr = pushDynamicBuffer(initial_size);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFixedBuffer(duk_idx_t obj, const string& key, int size, void** bufptr) {
         *bufptr = pushFixedBuffer(size);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectFixedBuffer(duk_idx_t obj, duk_idx_t key, int size, void** bufptr) {
         *bufptr = pushFixedBuffer(size);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectExternalBuffer(duk_idx_t obj, const string& key, void* ptr, size_t len) {
         pushExternalBuffer(ptr, len);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectExternalBuffer(duk_idx_t obj, duk_idx_t key, void* ptr, size_t len) {
         pushExternalBuffer(ptr, len);
-        if (!putProperty(obj>0?obj:obj - 1, key)) {
+        if (!putProperty(obj>=0?obj:obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectGlobalStash(duk_idx_t obj, const string& key) {
         pushGlobalStash();
-        if (!putProperty(obj > 0 ? obj : obj - 1, key)) {
+        if (!putProperty(obj >= 0 ? obj : obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectGlobalStash(duk_idx_t obj, duk_idx_t key) {
         pushGlobalStash();
-        if (!putProperty(obj > 0 ? obj : obj - 1, key)) {
+        if (!putProperty(obj >= 0 ? obj : obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectHeapStash(duk_idx_t obj, const string& key) {
         pushHeapStash();
-        if (!putProperty(obj > 0 ? obj : obj - 1, key)) {
+        if (!putProperty(obj >= 0 ? obj : obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
     
     inline void putObjectHeapStash(duk_idx_t obj, duk_idx_t key) {
         pushHeapStash();
-        if (!putProperty(obj > 0 ? obj : obj - 1, key)) {
+        if (!putProperty(obj >= 0 ? obj : obj - 1, key)) {
             throw(InvalidObjectException(this, obj, "invalid object"));
         }
     }
@@ -1463,6 +1858,11 @@ public:
     inline void cborDecode(duk_idx_t obj) {
         duk_cbor_decode(ctx, obj, 0);
     }
+    inline void cborDecode(const string& str) {
+        void* buf = pushFixedBuffer(str.length());
+        if (str.length()) memcpy(buf, str.data(), str.length());
+        cborDecode(-1);
+    }
 
     inline string cborEncode(duk_idx_t obj) {
         duk_cbor_encode(ctx, obj, 0);
@@ -1475,3 +1875,181 @@ public:
     
 };
 
+template<> struct ofxDuktapeType<bool> {
+    static inline bool get(ofxDuktape& duk, duk_idx_t index) { return duk.requireBool(index); }
+    static inline void push(ofxDuktape& duk, bool value) { duk.pushBool(value); }
+};
+template<> struct ofxDuktapeType<double> {
+    static inline double get(ofxDuktape& duk, duk_idx_t index) { return duk.requireNumber(index); }
+    static inline void push(ofxDuktape& duk, double value) { duk.pushNumber(value); }
+};
+template<> struct ofxDuktapeType<string> {
+    static inline string get(ofxDuktape& duk, duk_idx_t index) { return duk.requireString(index); }
+    static inline void push(ofxDuktape& duk, const string& value) { duk.pushString(value); }
+};
+template<> struct ofxDuktapeType<const char*> {
+    static inline const char* get(ofxDuktape& duk, duk_idx_t index) { return duk.requireCString(index); }
+    static inline void push(ofxDuktape& duk, const char* value) { duk.pushString(value); }
+};
+// any other arithmetic type or enum goes through a JS number
+template<typename T>
+struct ofxDuktapeType<T, typename std::enable_if<std::is_floating_point<T>::value>::type> {
+    static inline T get(ofxDuktape& duk, duk_idx_t index) { return (T)duk.requireNumber(index); }
+    static inline void push(ofxDuktape& duk, T value) { duk.pushNumber((double)value); }
+};
+// integers truncate and saturate like duk_require_int, with NaN as 0; casting
+// a number out of the type's range directly would be undefined
+template<typename T>
+struct ofxDuktapeType<T, typename std::enable_if<std::is_integral<T>::value>::type> {
+    static inline T get(ofxDuktape& duk, duk_idx_t index) {
+        double value = duk.requireNumber(index);
+        if (value != value) return 0;
+        // the max of 64 bit types rounds up past the range, so compare inclusively
+        if (value <= (double)std::numeric_limits<T>::min()) return std::numeric_limits<T>::min();
+        if (value >= (double)std::numeric_limits<T>::max()) return std::numeric_limits<T>::max();
+        return (T)value;
+    }
+    static inline void push(ofxDuktape& duk, T value) { duk.pushNumber((double)value); }
+};
+template<typename T>
+struct ofxDuktapeType<T, typename std::enable_if<std::is_enum<T>::value>::type> {
+    typedef typename std::underlying_type<T>::type Underlying;
+    static inline T get(ofxDuktape& duk, duk_idx_t index) { return (T)ofxDuktapeType<Underlying>::get(duk, index); }
+    static inline void push(ofxDuktape& duk, T value) { duk.pushNumber((double)(Underlying)value); }
+};
+
+// a thread borrowed from a heap's pool for as long as the handle exists
+class ofxDukThread {
+public:
+    explicit ofxDukThread(ofxDuktape& duk): duk(&duk), thread(&duk.acquireThread()) {}
+    ofxDukThread(ofxDukThread&& other): duk(other.duk), thread(other.thread) {
+        other.thread = NULL;
+    }
+    ofxDukThread(const ofxDukThread&) = delete;
+    ofxDukThread& operator=(const ofxDukThread&) = delete;
+    ~ofxDukThread() { if (thread) duk->releaseThread(*thread); }
+    
+    inline ofxDuktape& operator*() const { return *thread; }
+    inline ofxDuktape* operator->() const { return thread; }
+    inline ofxDuktape* get() const { return thread; }
+protected:
+    ofxDuktape* duk;
+    ofxDuktape* thread;
+};
+
+// keeps a value alive in the heap for as long as the handle exists, so C++ can
+// hold on to functions and objects without looking them up by name again.
+// handles must not outlive the ofxDuktape they were created with
+class ofxDukRef {
+public:
+    ofxDukRef(): duk(NULL), slot(-1), heapptr(NULL) {}
+    // pins the value at index
+    ofxDukRef(ofxDuktape& duk, duk_idx_t index): duk(NULL), slot(-1), heapptr(NULL) {
+        reset(duk, index);
+    }
+    ofxDukRef(ofxDukRef&& other): duk(other.duk), slot(other.slot), heapptr(other.heapptr) {
+        other.duk = NULL;
+        other.slot = -1;
+        other.heapptr = NULL;
+    }
+    ofxDukRef& operator=(ofxDukRef&& other) {
+        if (this != &other) {
+            reset();
+            duk = other.duk;
+            slot = other.slot;
+            heapptr = other.heapptr;
+            other.duk = NULL;
+            other.slot = -1;
+            other.heapptr = NULL;
+        }
+        return *this;
+    }
+    ofxDukRef(const ofxDukRef&) = delete;
+    ofxDukRef& operator=(const ofxDukRef&) = delete;
+    ~ofxDukRef() { reset(); }
+    
+    // releases the pinned value (if any)
+    inline void reset() {
+        if (duk && slot >= 0) duk->unpinRef(slot);
+        duk = NULL;
+        slot = -1;
+        heapptr = NULL;
+    }
+    // releases the pinned value and pins the value at index instead
+    inline void reset(ofxDuktape& duk, duk_idx_t index) {
+        index = duk.normalizeIndex(index);
+        reset();
+        this->duk = &duk;
+        slot = duk.pinRef(index);
+        heapptr = duk.getHeapPtr(index);
+    }
+    // pushes the pinned value onto the stack it was pinned from
+    inline void push() const {
+        if (duk) push(*duk);
+    }
+    // pushes the pinned value onto another thread of the same heap
+    inline void push(ofxDuktape& other) const {
+        if (heapptr) {
+            other.pushHeapPtr(heapptr);
+        } else if (slot >= 0) {
+            other.pushRef(slot);
+        } else {
+            other.pushUndefined();
+        }
+    }
+    inline bool isValid() const { return duk != NULL; }
+    inline explicit operator bool() const { return isValid(); }
+    inline ofxDuktape* getDuktape() const { return duk; }
+    // the pinned value's heap pointer, NULL for primitives
+    inline void* getHeapPtr() const { return heapptr; }
+    
+protected:
+    ofxDuktape* duk;
+    int slot;
+    // heap-allocated values can be pushed back directly from their (pinned) pointer
+    void* heapptr;
+};
+
+// memory on its way between heaps, either detached from one with
+// detachBuffer() or allocated here for native code to fill. move-only,
+// frees the memory if it never gets attached with pushTransfer()
+class ofxDukTransfer {
+public:
+    ofxDukTransfer(): block(NULL), data(NULL), size(0) {}
+    explicit ofxDukTransfer(size_t size): block(::malloc(size ? size : 1)), data(block), size(block ? size : 0) {}
+    ofxDukTransfer(ofxDukTransfer&& other): block(other.block), data(other.data), size(other.size) {
+        other.block = other.data = NULL;
+        other.size = 0;
+    }
+    ofxDukTransfer& operator=(ofxDukTransfer&& other) {
+        if (this != &other) {
+            reset();
+            block = other.block;
+            data = other.data;
+            size = other.size;
+            other.block = other.data = NULL;
+            other.size = 0;
+        }
+        return *this;
+    }
+    ofxDukTransfer(const ofxDukTransfer&) = delete;
+    ofxDukTransfer& operator=(const ofxDukTransfer&) = delete;
+    ~ofxDukTransfer() { reset(); }
+    
+    inline void reset() {
+        ::free(block);
+        block = data = NULL;
+        size = 0;
+    }
+    inline void* getData() const { return data; }
+    inline size_t getSize() const { return size; }
+    inline bool isValid() const { return block != NULL; }
+    inline explicit operator bool() const { return isValid(); }
+    
+protected:
+    friend class ofxDuktape;
+    // the malloc'd block holding the data, which can start past a header
+    void* block;
+    void* data;
+    size_t size;
+};
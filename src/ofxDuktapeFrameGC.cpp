@@ -0,0 +1,56 @@
+//
+//  ofxDuktapeFrameGC.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapeFrameGC.h"
+
+ofxDuktapeFrameGC::ofxDuktapeFrameGC(ofxDuktape& duk): duk(duk), frameBudget(0), minDebt(0.25), deferring(true), deferred(false), frameStart(0), idleCollections(0) {
+    memset(&lastFrame, 0, sizeof(lastFrame));
+}
+
+ofxDuktapeFrameGC::~ofxDuktapeFrameGC() {
+    if (deferred) duk.endGCDeferral();
+}
+
+uint64_t ofxDuktapeFrameGC::getFrameBudget() {
+    if (frameBudget) return frameBudget;
+    float fps = ofGetTargetFrameRate();
+    return (uint64_t)(1000000.0 / (fps > 0 ? fps : 60.0));
+}
+
+void ofxDuktapeFrameGC::beginFrame() {
+    frameStart = ofGetElapsedTimeMicros();
+    // a frame that never got to draw still holds its deferral
+    if (deferring && !deferred) {
+        duk.beginGCDeferral();
+        deferred = true;
+    }
+}
+
+void ofxDuktapeFrameGC::endFrame() {
+    uint64_t now = ofGetElapsedTimeMicros();
+    uint64_t budget = getFrameBudget();
+    lastFrame.frameMicros = now - frameStart;
+    lastFrame.idleMicros = lastFrame.frameMicros < budget ? budget - lastFrame.frameMicros : 0;
+    lastFrame.debt = duk.getGCDebt();
+    lastFrame.collected = false;
+    lastFrame.pauseMicros = 0;
+    if (deferred) {
+        duk.endGCDeferral();
+        deferred = false;
+    }
+    // heaps change size slowly, so the last pause is a fair guess at the next one
+    uint64_t expected = duk.getGCStats().lastPauseMicros;
+    bool fits = lastFrame.debt >= minDebt && expected + expected / 2 <= lastFrame.idleMicros;
+    if (fits) {
+        duk.gc();
+        lastFrame.collected = true;
+    } else {
+        lastFrame.collected = duk.collectIfDue();
+    }
+    if (lastFrame.collected) {
+        lastFrame.pauseMicros = duk.getGCStats().lastPauseMicros;
+        idleCollections++;
+    }
+}
@@ -0,0 +1,63 @@
+//
+//  ofxDuktapeFrameGC.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  keeps garbage collection of a heap out of the frame's script work,
+//  collecting in the time left after drawing instead
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+// between beginFrame() and endFrame() the heap's due collections are
+// deferred (see ofxDuktape::beginGCDeferral()). endFrame() measures what is
+// left of the frame budget and collects there when the heap is in enough debt
+// and the last pause fits in it, or whenever a collection is due. Duktape's
+// voluntary collections can still land mid-frame unless the addon is built
+// with OFXDUKTAPE_FRAME_GC
+class ofxDuktapeFrameGC {
+public:
+    // what happened at the end of the last frame
+    struct FrameReport {
+        uint64_t frameMicros;   // from beginFrame() to endFrame()
+        uint64_t idleMicros;    // budget left after drawing
+        double debt;            // see ofxDuktape::getGCDebt()
+        bool collected;
+        uint64_t pauseMicros;   // of the collection, 0 if none
+    };
+
+    ofxDuktapeFrameGC(ofxDuktape& duk);
+    virtual ~ofxDuktapeFrameGC();
+
+    // ofxDukBindings calls these before the app's update and after the app's draw
+    void beginFrame();
+    void endFrame();
+
+    // microseconds per frame; 0 follows ofGetTargetFrameRate(), taking 60 fps when unset
+    inline void setFrameBudget(uint64_t micros) { frameBudget = micros; }
+    uint64_t getFrameBudget();
+    // debt from which idle time is used to collect ahead of the trigger
+    inline void setMinDebt(double debt) { minDebt = debt; }
+    inline double getMinDebt() const { return minDebt; }
+    // with deferral off, collections trigger wherever the allocations reach them
+    inline void setDeferring(bool enabled) { deferring = enabled; }
+    inline bool isDeferring() const { return deferring; }
+
+    inline const FrameReport& getLastFrame() const { return lastFrame; }
+    // collections run at the end of a frame; pauses of all collections are in
+    // ofxDuktape::getGCStats()
+    inline uint64_t getIdleCollections() const { return idleCollections; }
+
+protected:
+    ofxDuktape& duk;
+    uint64_t frameBudget;
+    double minDebt;
+    bool deferring;
+    // whether beginFrame() started a deferral endFrame() has yet to end
+    bool deferred;
+    uint64_t frameStart;
+    FrameReport lastFrame;
+    uint64_t idleCollections;
+};
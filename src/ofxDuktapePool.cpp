@@ -0,0 +1,112 @@
+//
+//  ofxDuktapePool.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapePool.h"
+
+const size_t ofxDuktapePool::sizeClasses[ofxDuktapePool::numSizeClasses] = {
+    16, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768, 1024
+};
+
+ofxDuktapePool::ofxDuktapePool() {
+    for (size_t i = 0; i < numSizeClasses; i++) {
+        freeLists[i] = NULL;
+    }
+}
+
+ofxDuktapePool::~ofxDuktapePool() {
+    // large blocks are owned by the heap and freed through free() before
+    // the pool goes away; slabs are released wholesale
+    for (void* slab: slabs) {
+        ::free(slab);
+    }
+}
+
+// large blocks past 4GB only need their size for copies into pooled blocks,
+// so saturating the header field is enough
+static inline uint32_t sizeField(size_t size) {
+    return (uint32_t)std::min<size_t>(size, 0xffffffff);
+}
+
+uint32_t ofxDuktapePool::classForSize(size_t size) {
+    for (uint32_t i = 0; i < numSizeClasses; i++) {
+        if (size <= sizeClasses[i]) return i;
+    }
+    return largeClass;
+}
+
+void ofxDuktapePool::refill(uint32_t sizeClass) {
+    size_t stride = headerSize + sizeClasses[sizeClass];
+    size_t count = slabSize / stride;
+    char* slab = (char*)::malloc(count * stride);
+    if (!slab) return;
+    slabs.push_back(slab);
+    // thread the new blocks into the free list, lowest address first
+    FreeBlock* head = freeLists[sizeClass];
+    for (size_t i = count; i > 0; i--) {
+        FreeBlock* block = (FreeBlock*)(slab + (i - 1) * stride + headerSize);
+        block->next = head;
+        head = block;
+    }
+    freeLists[sizeClass] = head;
+}
+
+void* ofxDuktapePool::alloc(size_t size) {
+    uint32_t sizeClass = classForSize(size);
+    if (sizeClass == largeClass) {
+        BlockHeader* header = (BlockHeader*)::malloc(headerSize + size);
+        if (!header) return NULL;
+        header->sizeClass = largeClass;
+        header->size = sizeField(size);
+        return (char*)header + headerSize;
+    }
+    if (!freeLists[sizeClass]) {
+        refill(sizeClass);
+        if (!freeLists[sizeClass]) return NULL;
+    }
+    FreeBlock* block = freeLists[sizeClass];
+    freeLists[sizeClass] = block->next;
+    BlockHeader* header = (BlockHeader*)((char*)block - headerSize);
+    header->sizeClass = sizeClass;
+    header->size = sizeField(size);
+    return block;
+}
+
+void* ofxDuktapePool::realloc(void* ptr, size_t size) {
+    if (!ptr) return alloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+    BlockHeader* header = (BlockHeader*)((char*)ptr - headerSize);
+    if (header->sizeClass == largeClass) {
+        if (size > maxPooledSize) {
+            header = (BlockHeader*)::realloc(header, headerSize + size);
+            if (!header) return NULL;
+            header->size = sizeField(size);
+            return (char*)header + headerSize;
+        }
+    } else if (size <= sizeClasses[header->sizeClass]) {
+        // still fits in the block we already have
+        header->size = sizeField(size);
+        return ptr;
+    }
+    void* moved = alloc(size);
+    if (!moved) return NULL;
+    memcpy(moved, ptr, std::min<size_t>(header->size, size));
+    free(ptr);
+    return moved;
+}
+
+void ofxDuktapePool::free(void* ptr) {
+    if (!ptr) return;
+    BlockHeader* header = (BlockHeader*)((char*)ptr - headerSize);
+    if (header->sizeClass == largeClass) {
+        ::free(header);
+        return;
+    }
+    FreeBlock* block = (FreeBlock*)ptr;
+    block->next = freeLists[header->sizeClass];
+    freeLists[header->sizeClass] = block;
+}
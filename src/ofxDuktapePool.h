@@ -0,0 +1,54 @@
+//
+//  ofxDuktapePool.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  size-classed slab allocator used by ofxDuktape heaps created
+//  with ofxDuktape::ALLOCATOR_POOL
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+class ofxDuktapePool {
+public:
+    // every block is prefixed by a header holding its size class,
+    // keeping the payload aligned to 8 bytes as Duktape expects
+    struct BlockHeader {
+        uint32_t sizeClass;
+        uint32_t size;
+    };
+    static const size_t headerSize = sizeof(BlockHeader);
+    static const size_t numSizeClasses = 12;
+    static const uint32_t largeClass = 0xffffffff;
+    // payload sizes for each class; anything bigger goes to malloc
+    static const size_t sizeClasses[numSizeClasses];
+    static const size_t maxPooledSize = 1024;
+    static const size_t slabSize = 64 * 1024;
+
+    ofxDuktapePool();
+    ~ofxDuktapePool();
+
+    void* alloc(size_t size);
+    void* realloc(void* ptr, size_t size);
+    void free(void* ptr);
+
+    // number of slabs currently reserved by the pool
+    inline size_t getSlabCount() const { return slabs.size(); }
+
+    // size class index for a payload size, or largeClass if it is not pooled
+    static uint32_t classForSize(size_t size);
+    // requested size of a block handed out by the pool
+    static inline size_t blockSize(void* ptr) {
+        return ((BlockHeader*)((char*)ptr - headerSize))->size;
+    }
+
+protected:
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+    FreeBlock* freeLists[numSizeClasses];
+    vector<void*> slabs;
+
+    void refill(uint32_t sizeClass);
+};
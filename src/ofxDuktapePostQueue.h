@@ -0,0 +1,59 @@
+//
+//  ofxDuktapePostQueue.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  lock-free multi-producer, single-consumer queue of calls posted to a
+//  heap from other threads
+//
+
+#pragma once
+
+#include "ofMain.h"
+
+class ofxDuktape;
+
+class ofxDuktapePostQueue {
+public:
+    typedef function<void(ofxDuktape&)> post_function;
+
+    ofxDuktapePostQueue(): head(new Node()), tail(head.load()) {}
+    ~ofxDuktapePostQueue() {
+        post_function fn;
+        while (pop(fn)) {}
+        delete tail;
+    }
+    ofxDuktapePostQueue(const ofxDuktapePostQueue&) = delete;
+    ofxDuktapePostQueue& operator=(const ofxDuktapePostQueue&) = delete;
+
+    // any thread. producers only contend on the exchange of the head
+    inline void push(post_function fn) {
+        Node* node = new Node();
+        node->fn = std::move(fn);
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+    // consumer thread only. false when empty, or when the next producer
+    // hasn't finished linking its node yet
+    inline bool pop(post_function& fn) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+        fn = std::move(next->fn);
+        delete tail;
+        tail = next;
+        return true;
+    }
+    // consumer thread only. marks the current end of the queue, so a run
+    // can stop there instead of chasing producers that keep posting
+    inline const void* mark() const { return head.load(std::memory_order_acquire); }
+    inline bool isPast(const void* mark) const { return tail == mark; }
+
+protected:
+    // the tail node is always a consumed placeholder; its successor holds the next call
+    struct Node {
+        atomic<Node*> next;
+        post_function fn;
+        Node(): next(nullptr) {}
+    };
+    atomic<Node*> head;
+    Node* tail;
+};
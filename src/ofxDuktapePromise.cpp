@@ -0,0 +1,249 @@
+//
+//  ofxDuktapePromise.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapePromise.h"
+
+// the Promise implementation itself. enqueue(job) hands a job to the C++
+// queue, unhandled(reason) reports a rejection nothing was listening to and
+// key is the hidden symbol each promise keeps its state under
+static const char* ofxDuktapePromiseHelpers =
+"(function (enqueue, unhandled, key) {\n"
+"    var PENDING = 0, FULFILLED = 1, REJECTED = 2;\n"
+"    function isCallable(f) { return typeof f === 'function'; }\n"
+"    function state(p) {\n"
+"        var s = p !== null && typeof p === 'object' ? p[key] : undefined;\n"
+"        if (!s) throw new TypeError('not a promise');\n"
+"        return s;\n"
+"    }\n"
+"    function settle(s, st, value) {\n"
+"        if (s.state !== PENDING) return;\n"
+"        var reactions = s.reactions;\n"
+"        s.state = st; s.value = value; s.reactions = null;\n"
+"        for (var i = 0; i < reactions.length; i++) react(reactions[i], st, value);\n"
+"        if (st === REJECTED && !s.handled) {\n"
+"            enqueue(function () { if (!s.handled) unhandled(value); });\n"
+"        }\n"
+"    }\n"
+"    function react(r, st, value) {\n"
+"        enqueue(function () {\n"
+"            var handler = st === FULFILLED ? r.onFulfilled : r.onRejected, result;\n"
+"            if (!isCallable(handler)) {\n"
+"                (st === FULFILLED ? r.resolve : r.reject)(value);\n"
+"                return;\n"
+"            }\n"
+"            try { result = handler(value); } catch (e) { r.reject(e); return; }\n"
+"            r.resolve(result);\n"
+"        });\n"
+"    }\n"
+"    function resolveWith(p, s, value) {\n"
+"        if (value === p) return settle(s, REJECTED, new TypeError('a promise cannot resolve to itself'));\n"
+"        if (value !== null && (typeof value === 'object' || typeof value === 'function')) {\n"
+"            var then;\n"
+"            try { then = value.then; } catch (e) { return settle(s, REJECTED, e); }\n"
+"            if (isCallable(then)) {\n"
+"                enqueue(function () {\n"
+"                    var fns = resolvingFunctions(p, s);\n"
+"                    try { then.call(value, fns.resolve, fns.reject); } catch (e) { fns.reject(e); }\n"
+"                });\n"
+"                return;\n"
+"            }\n"
+"        }\n"
+"        settle(s, FULFILLED, value);\n"
+"    }\n"
+"    function resolvingFunctions(p, s) {\n"
+"        var done = false;\n"
+"        return {\n"
+"            resolve: function (value) { if (!done) { done = true; resolveWith(p, s, value); } },\n"
+"            reject: function (reason) { if (!done) { done = true; settle(s, REJECTED, reason); } }\n"
+"        };\n"
+"    }\n"
+"    function Promise(executor) {\n"
+"        if (!(this instanceof Promise)) throw new TypeError('Promise must be called with new');\n"
+"        if (!isCallable(executor)) throw new TypeError('Promise executor is not a function');\n"
+"        var s = { state: PENDING, value: undefined, reactions: [], handled: false };\n"
+"        this[key] = s;\n"
+"        var fns = resolvingFunctions(this, s);\n"
+"        try { executor(fns.resolve, fns.reject); } catch (e) { fns.reject(e); }\n"
+"    }\n"
+"    function deferred() {\n"
+"        var d = {};\n"
+"        d.promise = new Promise(function (resolve, reject) { d.resolve = resolve; d.reject = reject; });\n"
+"        return d;\n"
+"    }\n"
+"    Promise.prototype.then = function (onFulfilled, onRejected) {\n"
+"        var s = state(this), d = deferred();\n"
+"        var r = { onFulfilled: onFulfilled, onRejected: onRejected, resolve: d.resolve, reject: d.reject };\n"
+"        s.handled = true;\n"
+"        if (s.state === PENDING) s.reactions.push(r); else react(r, s.state, s.value);\n"
+"        return d.promise;\n"
+"    };\n"
+"    Promise.prototype['catch'] = function (onRejected) { return this.then(undefined, onRejected); };\n"
+"    Promise.prototype['finally'] = function (f) {\n"
+"        if (!isCallable(f)) return this.then(f, f);\n"
+"        return this.then(\n"
+"            function (v) { return Promise.resolve(f()).then(function () { return v; }); },\n"
+"            function (e) { return Promise.resolve(f()).then(function () { throw e; }); });\n"
+"    };\n"
+"    Promise.resolve = function (value) {\n"
+"        if (value instanceof Promise) return value;\n"
+"        return new Promise(function (resolve) { resolve(value); });\n"
+"    };\n"
+"    Promise.reject = function (reason) {\n"
+"        return new Promise(function (resolve, reject) { reject(reason); });\n"
+"    };\n"
+"    function each(list, onFulfilled, onRejected, done) {\n"
+"        var remaining = 1, n = list.length, i;\n"
+"        function settled() { if (--remaining === 0) done(); }\n"
+"        function add(i) {\n"
+"            remaining++;\n"
+"            Promise.resolve(list[i]).then(\n"
+"                function (v) { onFulfilled(i, v); settled(); },\n"
+"                function (e) { onRejected(i, e); settled(); });\n"
+"        }\n"
+"        for (i = 0; i < n; i++) add(i);\n"
+"        settled();\n"
+"    }\n"
+"    Promise.all = function (list) {\n"
+"        return new Promise(function (resolve, reject) {\n"
+"            var values = new Array(list.length);\n"
+"            each(list, function (i, v) { values[i] = v; }, function (i, e) { reject(e); },\n"
+"                 function () { resolve(values); });\n"
+"        });\n"
+"    };\n"
+"    Promise.allSettled = function (list) {\n"
+"        return new Promise(function (resolve) {\n"
+"            var results = new Array(list.length);\n"
+"            each(list, function (i, v) { results[i] = { status: 'fulfilled', value: v }; },\n"
+"                 function (i, e) { results[i] = { status: 'rejected', reason: e }; },\n"
+"                 function () { resolve(results); });\n"
+"        });\n"
+"    };\n"
+"    Promise.race = function (list) {\n"
+"        return new Promise(function (resolve, reject) {\n"
+"            for (var i = 0; i < list.length; i++) Promise.resolve(list[i]).then(resolve, reject);\n"
+"        });\n"
+"    };\n"
+"    return {\n"
+"        Promise: Promise,\n"
+"        deferred: deferred,\n"
+"        queueMicrotask: function (fn) {\n"
+"            if (!isCallable(fn)) throw new TypeError('queueMicrotask needs a function');\n"
+"            enqueue(fn);\n"
+"        }\n"
+"    };\n"
+"})";
+
+void ofxDukPromise::settle(bool fulfill) {
+    if (!isPending()) {
+        if (duk) duk->pop();
+        return;
+    }
+    ofxDuktape& duk = *this->duk;
+    (fulfill ? resolveFn : rejectFn).push(duk);
+    duk.swap(-1, -2);
+    if (duk.pCall(1) != 0) {
+        ofLogError("ofxDukPromise") << duk.safeToString(-1);
+    }
+    duk.pop();
+    resolveFn.reset();
+    rejectFn.reset();
+}
+
+void ofxDukPromise::resolve() {
+    settle(true);
+}
+
+void ofxDukPromise::reject() {
+    settle(false);
+}
+
+void ofxDukPromise::reject(const string& message) {
+    if (!isPending()) return;
+    duk->pushError(DUK_ERR_ERROR, message);
+    settle(false);
+}
+
+ofxDuktapePromises::ofxDuktapePromises(ofxDuktape& duk):
+duk(duk), jobLimit(10000), draining(false) {
+}
+
+ofxDuktapePromises::~ofxDuktapePromises() {
+}
+
+void ofxDuktapePromises::setup() {
+    if (duk.pEvalString(ofxDuktapePromiseHelpers) != 0) {
+        ofLogError("ofxDuktapePromises") << duk.safeToString(-1);
+        duk.pop();
+        return;
+    }
+    duk.pushFunction([this](ofxDuktape& ctx) {
+        // jobs can be queued from inside a coroutine; they're pinned
+        // from the main stack so the ref doesn't outlive the thread it came from
+        if (&ctx == &duk) {
+            jobs.push_back(ofxDukRef(duk, 0));
+        } else {
+            duk.xcopyTop(&ctx, 1);
+            jobs.push_back(ofxDukRef(duk, -1));
+            duk.pop();
+        }
+        return 0;
+    }, 1);
+    duk.pushFunction([](ofxDuktape& ctx) {
+        ofLogError("ofxDuktapePromises") << "unhandled rejection: " << ctx.safeToString(0);
+        return 0;
+    }, 1);
+    duk.pushString(DUK_HIDDEN_SYMBOL("ofxDukPromiseState"));
+    duk.call(3);
+    duk_idx_t helpers = duk.normalizeIndex(-1);
+    duk.getPropString(helpers, "deferred");
+    deferred.reset(duk, -1);
+    duk.pop();
+    duk.getPropString(helpers, "Promise");
+    duk.putGlobalString("Promise");
+    duk.getPropString(helpers, "queueMicrotask");
+    duk.putGlobalString("queueMicrotask");
+    duk.pop();
+}
+
+size_t ofxDuktapePromises::drain() {
+    // a job draining the queue itself would run everything out of order
+    if (draining) return 0;
+    draining = true;
+    size_t count = 0;
+    while (!jobs.empty() && (jobLimit == 0 || count < jobLimit)) {
+        ofxDukRef job = std::move(jobs.front());
+        jobs.pop_front();
+        job.push(duk);
+        if (duk.pCall(0) != 0) {
+            ofLogError("ofxDuktapePromises") << duk.safeToString(-1);
+        }
+        duk.pop();
+        count++;
+    }
+    draining = false;
+    return count;
+}
+
+ofxDukPromise ofxDuktapePromises::pushPromise() {
+    ofxDukPromise promise;
+    if (!deferred) {
+        ofLogError("ofxDuktapePromises") << "pushPromise() called before setup()";
+        duk.pushUndefined();
+        return promise;
+    }
+    promise.duk = &duk;
+    deferred.push(duk);
+    duk.call(0);
+    duk.getPropString(-1, "resolve");
+    promise.resolveFn.reset(duk, -1);
+    duk.pop();
+    duk.getPropString(-1, "reject");
+    promise.rejectFn.reset(duk, -1);
+    duk.pop();
+    duk.getPropString(-1, "promise");
+    duk.swap(-1, -2);
+    duk.pop();
+    return promise;
+}
@@ -0,0 +1,79 @@
+//
+//  ofxDuktapePromise.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  Promise for heaps built without Duktape's Promise builtin, with the
+//  microtask queue kept on the C++ side and drained by the host
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+// the host side of a promise pushed by ofxDuktapePromises::pushPromise().
+// settling it only queues the promise's reactions; they run on the next drain()
+class ofxDukPromise {
+public:
+    ofxDukPromise(): duk(NULL) {}
+    ofxDukPromise(ofxDukPromise&&) = default;
+    ofxDukPromise& operator=(ofxDukPromise&&) = default;
+
+    // fulfills the promise with the value on top of the stack of the heap it
+    // was created in, popping the value. once settled, the value is only popped
+    void resolve();
+    // fulfills the promise with a value converted like typed function results
+    template<typename T>
+    inline void resolve(const T& value) {
+        if (!isPending()) return;
+        ofxDuktapeType<typename std::decay<T>::type>::push(*duk, value);
+        resolve();
+    }
+    // rejects the promise with the value on top of the stack, popping it
+    void reject();
+    // rejects the promise with a new Error
+    void reject(const string& message);
+
+    // whether the promise still has to be settled from here
+    inline bool isPending() const { return resolveFn.isValid(); }
+
+protected:
+    friend class ofxDuktapePromises;
+    ofxDuktape* duk;
+    ofxDukRef resolveFn;
+    ofxDukRef rejectFn;
+    void settle(bool fulfill);
+};
+
+// scripts get global Promise (with then/catch/finally, resolve, reject,
+// all, race and allSettled) and queueMicrotask(fn). promise reactions and
+// queued microtasks wait in a queue until drain() runs them, so they happen
+// at a known point of the frame rather than in the middle of host code
+class ofxDuktapePromises {
+public:
+    ofxDuktapePromises(ofxDuktape& duk);
+    virtual ~ofxDuktapePromises();
+
+    // installs the globals, replacing any Promise already there
+    void setup();
+    // runs queued jobs, including the ones they queue, until the queue is
+    // empty or the job limit is reached; returns the number of jobs run
+    size_t drain();
+
+    // pushes a new pending promise, returning the handle that settles it
+    ofxDukPromise pushPromise();
+
+    // jobs a single drain() runs at most, 0 for no limit. whatever is left
+    // waits for the next drain, so a promise loop can't hang the frame
+    inline void setJobLimit(size_t jobs) { jobLimit = jobs; }
+    inline size_t getJobLimit() const { return jobLimit; }
+    inline size_t getPendingCount() const { return jobs.size(); }
+
+protected:
+    ofxDuktape& duk;
+    deque<ofxDukRef> jobs;
+    size_t jobLimit;
+    bool draining;
+    // script helper returning a new promise with its resolving functions
+    ofxDukRef deferred;
+};
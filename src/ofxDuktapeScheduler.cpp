@@ -0,0 +1,168 @@
+//
+//  ofxDuktapeScheduler.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapeScheduler.h"
+
+// Duktape only resumes and yields coroutines from script functions, so the
+// scheduler drives them through these. tasks spawned from script are only
+// queued, as their threads can't be pinned from inside another task.
+// setWake(frames, ms) records when the task being resumed wants to continue,
+// and newId() hands out task ids
+static const char* ofxDuktapeSchedulerHelpers =
+"(function (setWake, newId) {\n"
+"    var Thread = Duktape.Thread, resume = Thread.resume, suspend = Thread.yield;\n"
+"    var done = {}, pending = [];\n"
+"    return {\n"
+"        resume: function (t) { return resume(t) === done; },\n"
+"        pending: pending,\n"
+"        api: {\n"
+"            spawn: function (fn, arg) {\n"
+"                var id = newId();\n"
+"                pending.push(id, new Thread(function () { fn(arg); return done; }));\n"
+"                return id;\n"
+"            },\n"
+"            yield: function () { suspend(); },\n"
+"            waitFrames: function (n) { setWake(n, 0); suspend(); },\n"
+"            sleep: function (ms) { setWake(0, ms); suspend(); }\n"
+"        }\n"
+"    };\n"
+"})";
+
+ofxDuktapeScheduler::ofxDuktapeScheduler(ofxDuktape& duk):
+duk(duk), frame(0), timeSlice(5000), taskBudget(0), nextId(1), current(NULL) {
+}
+
+ofxDuktapeScheduler::~ofxDuktapeScheduler() {
+}
+
+void ofxDuktapeScheduler::setup(const string& globalName) {
+    if (duk.pEvalString(ofxDuktapeSchedulerHelpers) != 0) {
+        ofLogError("ofxDuktapeScheduler") << duk.safeToString(-1);
+        duk.pop();
+        return;
+    }
+    duk.pushFunction([this](ofxDuktape& duk) {
+        if (!current) return 0;
+        int frames = duk.getInt(0);
+        double ms = duk.getNumber(1);
+        current->wakeFrame = frame + std::max(frames, 1);
+        current->wakeTime = ms > 0 ? ofGetElapsedTimeMicros() + (uint64_t)(ms * 1000.0) : 0;
+        return 0;
+    }, 2);
+    duk.pushFunction([this](ofxDuktape& duk) {
+        duk.pushInt(nextId++);
+        return 1;
+    }, 0);
+    duk.call(2);
+    duk_idx_t helpers = duk.normalizeIndex(-1);
+    duk.getPropString(helpers, "resume");
+    resumeTask.reset(duk, -1);
+    duk.pop();
+    duk.getPropString(helpers, "pending");
+    pending.reset(duk, -1);
+    duk.pop();
+
+    duk.getPropString(helpers, "api");
+    api.reset(duk, -1);
+    duk.pushFunction([this](ofxDuktape& duk) {
+        cancel(duk.getInt(0));
+        return 0;
+    }, 1);
+    duk.putPropString(-2, "cancel");
+    duk.putGlobalString(globalName);
+    duk.pop();
+}
+
+void ofxDuktapeScheduler::addPending() {
+    pending.push(duk);
+    duk_idx_t list = duk.normalizeIndex(-1);
+    size_t length = duk.getLength(list);
+    for (size_t i = 0; i + 1 < length; i += 2) {
+        Task task;
+        task.id = duk.getObjectInt(list, (duk_idx_t)i);
+        duk.pop();
+        duk.getPropIndex(list, i + 1);
+        task.thread.reset(duk, -1);
+        duk.pop();
+        task.wakeFrame = frame + 1;
+        task.wakeTime = 0;
+        if (cancelled.erase(task.id)) continue;
+        tasks.push_back(std::move(task));
+    }
+    duk.setLength(list, 0);
+    duk.pop();
+    // no task is running, so what is left were ids that finished meanwhile
+    cancelled.clear();
+}
+
+int ofxDuktapeScheduler::spawn(duk_idx_t index) {
+    index = duk.normalizeIndex(index);
+    api.push(duk);
+    duk.getPropString(-1, "spawn");
+    duk.swap(-1, -2);
+    duk.dup(index);
+    int id = -1;
+    if (duk.pCallMethod(1) != 0) {
+        ofLogError("ofxDuktapeScheduler") << duk.safeToString(-1);
+    } else {
+        id = duk.getInt(-1);
+    }
+    duk.pop();
+    if (!current) addPending();
+    return id;
+}
+
+void ofxDuktapeScheduler::cancel(int id) {
+    if (current && current->id == id) {
+        // stopped once it suspends
+        cancelled.insert(id);
+        return;
+    }
+    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+        if (it->id == id) {
+            tasks.erase(it);
+            return;
+        }
+    }
+    // possibly spawned from script and not picked up yet; ids never handed out are ignored
+    if (id > 0 && id < nextId) cancelled.insert(id);
+}
+
+void ofxDuktapeScheduler::update() {
+    addPending();
+    frame++;
+    uint64_t start = ofGetElapsedTimeMicros();
+    size_t count = tasks.size();
+    for (size_t i = 0; i < count && !tasks.empty(); i++) {
+        uint64_t now = ofGetElapsedTimeMicros();
+        if (timeSlice && i > 0 && now - start >= timeSlice) break;
+        Task task = std::move(tasks.front());
+        tasks.pop_front();
+        if (task.wakeFrame > frame || task.wakeTime > now) {
+            tasks.push_back(std::move(task));
+            continue;
+        }
+        // yielding without asking for anything else means the next update
+        task.wakeFrame = frame + 1;
+        task.wakeTime = 0;
+        current = &task;
+        resumeTask.push(duk);
+        task.thread.push(duk);
+        bool finished;
+        int ret = taskBudget ? duk.pCallBudgeted(1, taskBudget) : duk.pCall(1);
+        if (ret != 0) {
+            ofLogError("ofxDuktapeScheduler") << "task " << task.id << ": " << duk.safeToString(-1);
+            finished = true;
+        } else {
+            finished = duk.getBool(-1);
+        }
+        duk.pop();
+        current = NULL;
+        if (cancelled.erase(task.id)) finished = true;
+        if (!finished) {
+            tasks.push_back(std::move(task));
+        }
+    }
+}
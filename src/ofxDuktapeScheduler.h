@@ -0,0 +1,76 @@
+//
+//  ofxDuktapeScheduler.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  cooperative tasks running as Duktape coroutines, resumed a slice
+//  of time per frame
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+// scripts get a global object (`tasks` by default) with:
+//   spawn(fn, arg)   runs fn(arg) as a task from the next update, returns its id
+//   cancel(id)       stops a task (a running one once it suspends)
+//   yield()          (inside a task) continues on the next update
+//   waitFrames(n)    (inside a task) continues n updates from now
+//   sleep(ms)        (inside a task) continues once ms milliseconds have passed
+// tasks can only suspend from script code, not from inside a native call
+class ofxDuktapeScheduler {
+public:
+    ofxDuktapeScheduler(ofxDuktape& duk);
+    virtual ~ofxDuktapeScheduler();
+
+    // installs the script side of the scheduler
+    void setup(const string& globalName = "tasks");
+    // runs the tasks that are due, round-robin, until they have all suspended
+    // or the time slice is used up; tasks left out go first on the next update
+    void update();
+
+    // spawns the function at index as a task, returns its id (-1 on failure)
+    int spawn(duk_idx_t index);
+    void cancel(int id);
+
+    // microseconds all tasks get per update, 0 for no limit. tasks are only
+    // stopped between resumes, so one task running long still runs to its next
+    // suspension, however long that takes, unless it has a task budget
+    inline void setTimeSlice(uint64_t micros) { timeSlice = micros; }
+    inline uint64_t getTimeSlice() const { return timeSlice; }
+    // microseconds a task may run from one resume to its next suspension, 0
+    // for no limit (the default). a task running past it is stopped with an
+    // error, through the heap's execution budget (see pCallBudgeted())
+    inline void setTaskBudget(uint64_t micros) { taskBudget = micros; }
+    inline uint64_t getTaskBudget() const { return taskBudget; }
+    inline size_t getTaskCount() const { return tasks.size(); }
+    inline uint64_t getFrame() const { return frame; }
+
+protected:
+    struct Task {
+        int id;
+        ofxDukRef thread;
+        uint64_t wakeFrame;
+        uint64_t wakeTime;
+    };
+    ofxDuktape& duk;
+    deque<Task> tasks;
+    // ids cancelled while running or before being picked up, cleared once
+    // those are reaped
+    set<int> cancelled;
+    uint64_t frame;
+    uint64_t timeSlice;
+    uint64_t taskBudget;
+    // the id the next spawned task gets
+    int nextId;
+    // the task being resumed, which wake requests from script apply to
+    Task* current;
+    // script helpers: resume(thread) -> whether the task finished, the
+    // [id, thread, ...] array of tasks spawned since the last update, and the script API
+    ofxDukRef resumeTask;
+    ofxDukRef pending;
+    ofxDukRef api;
+
+    // picks up tasks spawned from script; only called while no task is running
+    void addPending();
+};
@@ -0,0 +1,104 @@
+//
+//  ofxDuktapeTemplate.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapeTemplate.h"
+
+// freezes a value, the prototypes it inherits from and everything reachable
+// from them through own properties, so a sandbox can't reach anything shared it
+// could change. buffers can't be frozen, so they (and their contents) stay writable
+static const char* ofxDuktapeTemplateFreeze =
+"(function freeze(o) {\n"
+"    if (o === null || (typeof o !== 'object' && typeof o !== 'function') || Object.isFrozen(o)) return;\n"
+"    if (o instanceof ArrayBuffer || ArrayBuffer.isView(o)) return freeze(Object.getPrototypeOf(o));\n"
+"    Object.freeze(o);\n"
+"    freeze(Object.getPrototypeOf(o));\n"
+"    Object.getOwnPropertyNames(o).concat(Object.getOwnPropertySymbols(o)).forEach(function (k) {\n"
+"        var d = Object.getOwnPropertyDescriptor(o, k);\n"
+"        if ('value' in d) freeze(d.value);\n"
+"        else { freeze(d.get); freeze(d.set); }\n"
+"    });\n"
+"})";
+
+static set<string> ofxDuktapeGlobalNames(ofxDuktape& duk) {
+    set<string> names;
+    duk.pushGlobalObject();
+    duk._enum(-1, DUK_ENUM_OWN_PROPERTIES_ONLY | DUK_ENUM_INCLUDE_NONENUMERABLE);
+    while (duk.next(-1, false)) {
+        names.insert(duk.getString(-1));
+        duk.pop();
+    }
+    duk.pop(2);
+    return names;
+}
+
+ofxDuktapeTemplate::ofxDuktapeTemplate(ofxDuktape::AllocatorMode mode): heap(mode) {
+}
+
+ofxDuktapeTemplate::~ofxDuktapeTemplate() {
+    for (auto& sandbox: sandboxes) {
+        delete sandbox.first;
+    }
+    sandboxes.clear();
+}
+
+void ofxDuktapeTemplate::setup(setup_function fn) {
+    set<string> before = ofxDuktapeGlobalNames(heap);
+    fn(heap);
+    set<string> after = ofxDuktapeGlobalNames(heap);
+
+    if (!shared) {
+        heap.pushBareObject();
+        shared.reset(heap, -1);
+        heap.pop();
+    }
+    if (heap.pEvalString(ofxDuktapeTemplateFreeze) != 0) {
+        ofLogError("ofxDuktapeTemplate") << heap.safeToString(-1);
+        heap.pop();
+        return;
+    }
+    shared.push(heap);
+    for (const string& name: after) {
+        if (before.count(name)) continue;
+        heap.dup(-2);
+        heap.getGlobalString(name);
+        if (heap.pCall(1) != 0) {
+            ofLogError("ofxDuktapeTemplate") << name << ": " << heap.safeToString(-1);
+        }
+        heap.pop();
+        heap.getGlobalString(name);
+        heap.putPropString(-2, name);
+        sharedNames.push_back(name);
+    }
+    heap.pop(2);
+}
+
+ofxDuktape* ofxDuktapeTemplate::createSandbox() {
+    // leaves the new thread on the template heap's stack
+    ofxDuktape* sandbox = new ofxDuktape(&heap, true);
+    ofxDukRef thread(heap, -1);
+    heap.pop();
+    if (shared) {
+        sandbox->pushGlobalObject();
+        shared.push(*sandbox);
+        for (const string& name: sharedNames) {
+            sandbox->getPropString(-1, name);
+            sandbox->putPropString(-3, name);
+        }
+        sandbox->pop(2);
+    }
+    sandboxes.emplace(sandbox, std::move(thread));
+    return sandbox;
+}
+
+void ofxDuktapeTemplate::destroySandbox(ofxDuktape* sandbox) {
+    auto it = sandboxes.find(sandbox);
+    if (it == sandboxes.end()) {
+        ofLogError("ofxDuktapeTemplate") << "not a sandbox of this template";
+        return;
+    }
+    delete sandbox;
+    // the thread is collected once nothing else refers to it
+    sandboxes.erase(it);
+}
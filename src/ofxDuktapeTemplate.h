@@ -0,0 +1,50 @@
+//
+//  ofxDuktapeTemplate.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  a heap set up once, stamping out sandboxes that share what was set up
+//  instead of building it again
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+// sandboxes are threads of the template heap, each with a global environment
+// and built-ins of its own. the globals added by setup() are deep-frozen, along
+// with the template realm's prototypes they inherit from (Object.prototype,
+// Function.prototype...), and put in every sandbox's global object by
+// reference, so a sandbox can replace them but not change them for the others.
+// code on the template heap itself can't extend those prototypes afterwards.
+// shared values come from the template's realm, so `instanceof Array` and the
+// like fail on them in a sandbox.
+// sandboxes share the template heap's memory, limits and execution budget
+class ofxDuktapeTemplate {
+public:
+    typedef function<void(ofxDuktape&)> setup_function;
+
+    ofxDuktapeTemplate(ofxDuktape::AllocatorMode mode = ofxDuktape::ALLOCATOR_MALLOC);
+    // sandboxes still around are destroyed along with the heap
+    virtual ~ofxDuktapeTemplate();
+
+    // runs fn on the template heap and shares the globals it adds. can be
+    // called more than once; sandboxes created earlier don't get the new globals
+    void setup(setup_function fn);
+
+    // a new sandbox holding the shared globals, owned by the template
+    ofxDuktape* createSandbox();
+    void destroySandbox(ofxDuktape* sandbox);
+
+    inline ofxDuktape& getHeap() { return heap; }
+    inline size_t getSandboxCount() const { return sandboxes.size(); }
+    inline const vector<string>& getSharedNames() const { return sharedNames; }
+
+protected:
+    ofxDuktape heap;
+    // shared globals, by name
+    ofxDukRef shared;
+    vector<string> sharedNames;
+    // keeps each sandbox's thread alive
+    map<ofxDuktape*, ofxDukRef> sandboxes;
+};
@@ -0,0 +1,303 @@
+//
+//  ofxDuktapeWorker.cpp
+//  openFrameworks addon for interacting with the Duktape VM
+//
+
+#include "ofxDuktapeWorker.h"
+
+// the handle objects pushed to the main heap point back at their worker through this
+static const char* ofxDuktapeWorkerProp = DUK_HIDDEN_SYMBOL("ofxDuktapeWorker");
+
+ofxDuktapeWorkerPool::ofxDuktapeWorkerPool(size_t count): stopping(false) {
+    if (count == 0) {
+        unsigned int cores = thread::hardware_concurrency();
+        count = cores > 1 ? cores - 1 : 1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        threads.push_back(thread(&ofxDuktapeWorkerPool::threadedFunction, this));
+    }
+}
+
+ofxDuktapeWorkerPool::~ofxDuktapeWorkerPool() {
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (thread& t: threads) {
+        t.join();
+    }
+}
+
+ofxDuktapeWorkerPool& ofxDuktapeWorkerPool::getShared() {
+    static ofxDuktapeWorkerPool shared;
+    return shared;
+}
+
+void ofxDuktapeWorkerPool::schedule(ofxDuktapeWorker* worker) {
+    {
+        lock_guard<mutex> guard(lock);
+        ready.push_back(worker);
+    }
+    wake.notify_one();
+}
+
+void ofxDuktapeWorkerPool::unschedule(ofxDuktapeWorker* worker) {
+    // called with the lock held
+    ready.erase(std::remove(ready.begin(), ready.end(), worker), ready.end());
+}
+
+void ofxDuktapeWorkerPool::run(const vector<function<void()>>& batch) {
+    if (batch.empty()) return;
+    size_t remaining = batch.size();
+    unique_lock<mutex> guard(lock);
+    for (const function<void()>& fn: batch) {
+        jobs.push_back(Job{fn, &remaining});
+    }
+    wake.notify_all();
+    while (remaining) {
+        // only this batch: submitted jobs (another heap's pipelined update, a
+        // file being read) must not end up on the calling thread
+        auto own = std::find_if(jobs.begin(), jobs.end(), [&remaining](const Job& job) {
+            return job.remaining == &remaining;
+        });
+        if (own != jobs.end()) {
+            Job job = std::move(*own);
+            jobs.erase(own);
+            runJob(job, guard);
+        } else {
+            jobsDone.wait(guard);
+        }
+    }
+}
+
+void ofxDuktapeWorkerPool::submit(function<void()> job) {
+    {
+        lock_guard<mutex> guard(lock);
+        jobs.push_back(Job{std::move(job), NULL});
+    }
+    wake.notify_one();
+}
+
+void ofxDuktapeWorkerPool::runJob(Job& job, unique_lock<mutex>& guard) {
+    guard.unlock();
+    job.fn();
+    guard.lock();
+    if (job.remaining && --*job.remaining == 0) jobsDone.notify_all();
+}
+
+void ofxDuktapeWorkerPool::threadedFunction() {
+    unique_lock<mutex> guard(lock);
+    while (true) {
+        wake.wait(guard, [this] { return stopping || !ready.empty() || !jobs.empty(); });
+        if (stopping) break;
+        if (!jobs.empty()) {
+            Job job = std::move(jobs.front());
+            jobs.pop_front();
+            runJob(job, guard);
+            continue;
+        }
+        ofxDuktapeWorker* worker = ready.front();
+        ready.pop_front();
+        {
+            // marked under the pool lock so a worker being destroyed either
+            // finds itself still queued or waits for this run to end
+            lock_guard<mutex> workerGuard(worker->lock);
+            worker->running = true;
+        }
+        guard.unlock();
+        worker->process();
+        guard.lock();
+        bool more;
+        {
+            lock_guard<mutex> workerGuard(worker->lock);
+            worker->running = false;
+            more = !worker->destroying && !worker->inbox.empty();
+            worker->scheduled = more;
+            worker->idle.notify_all();
+        }
+        if (more) {
+            // back of the line, so busy workers don't starve the others
+            ready.push_back(worker);
+            wake.notify_one();
+        }
+    }
+}
+
+ofxDuktapeWorker::ofxDuktapeWorker(ofxDuktapeWorkerPool& pool):
+pool(pool), heap(NULL), started(false), scheduled(false), running(false), destroying(false), handleHeap(NULL), deliveryPosted(false), alive(make_shared<bool>(true)) {
+}
+
+ofxDuktapeWorker::~ofxDuktapeWorker() {
+    {
+        lock_guard<mutex> poolGuard(pool.lock);
+        pool.unschedule(this);
+        lock_guard<mutex> guard(lock);
+        destroying = true;
+    }
+    {
+        unique_lock<mutex> guard(lock);
+        idle.wait(guard, [this] { return !running; });
+    }
+    revokeHandle();
+    *alive = false;
+    delete heap;
+}
+
+void ofxDuktapeWorker::revokeHandle() {
+    if (!handle) return;
+    ofxDuktape& duk = *handle.getDuktape();
+    ofRemoveListener(duk.onDestroy, this, &ofxDuktapeWorker::onHeapDestroy);
+    {
+        lock_guard<mutex> guard(lock);
+        handleHeap = NULL;
+    }
+    // the handle can outlive us in the main heap
+    handle.push();
+    duk.putObjectPointer(-1, ofxDuktapeWorkerProp, NULL);
+    duk.pop();
+    handle.reset();
+}
+
+void ofxDuktapeWorker::onHeapDestroy(ofxDuktape::DestroyEvent& ev) {
+    revokeHandle();
+}
+
+void ofxDuktapeWorker::postDelivery() {
+    if (!handleHeap || deliveryPosted || outbox.empty()) return;
+    deliveryPosted = true;
+    shared_ptr<bool> alive = this->alive;
+    handleHeap->post([this, alive](ofxDuktape&) {
+        if (*alive) update();
+    });
+}
+
+void ofxDuktapeWorker::start(const string& script, const string& filename, setup_function setup) {
+    bool schedule;
+    {
+        lock_guard<mutex> guard(lock);
+        if (started) {
+            ofLogError("ofxDuktapeWorker") << "worker already started";
+            return;
+        }
+        this->script = script;
+        this->filename = filename;
+        this->setup = setup;
+        started = true;
+        schedule = !scheduled;
+        scheduled = true;
+    }
+    if (schedule) pool.schedule(this);
+}
+
+void ofxDuktapeWorker::post(deque<string>& queue, const string& message) {
+    bool schedule = false;
+    {
+        lock_guard<mutex> guard(lock);
+        queue.push_back(message);
+        if (&queue == &inbox && started && !scheduled && !destroying) {
+            schedule = scheduled = true;
+        }
+        if (&queue == &outbox) postDelivery();
+    }
+    if (schedule) pool.schedule(this);
+}
+
+void ofxDuktapeWorker::postMessage(ofxDuktape& duk, duk_idx_t index) {
+    duk.dup(index);
+    post(inbox, duk.cborEncode(-1));
+}
+
+void ofxDuktapeWorker::postMessage(const string& cbor) {
+    post(inbox, cbor);
+}
+
+size_t ofxDuktapeWorker::getPendingCount() {
+    lock_guard<mutex> guard(lock);
+    return inbox.size();
+}
+
+void ofxDuktapeWorker::process() {
+    if (!heap) {
+        heap = new ofxDuktape();
+        heap->pushFunction([this](ofxDuktape& duk) {
+            duk.dup(0);
+            post(outbox, duk.cborEncode(-1));
+            return 0;
+        }, 1);
+        heap->putGlobalString("postMessage");
+        if (setup) setup(*heap);
+        if (heap->pCompileStringFilename(filename, script, 0) != 0 || heap->pCall(0) != 0) {
+            ofLogError("ofxDuktapeWorker") << filename << ": " << heap->safeToString(-1);
+        }
+        heap->pop();
+    }
+    deque<string> messages;
+    {
+        lock_guard<mutex> guard(lock);
+        messages.swap(inbox);
+    }
+    for (const string& message: messages) {
+        int ret = heap->safeCall([&message](ofxDuktape& duk) {
+            if (!duk.getGlobalString("onmessage") || !duk.isFunction(-1)) return 0;
+            duk.cborDecode(message);
+            duk.call(1);
+            return 0;
+        }, 0, 1);
+        if (ret != DUK_EXEC_SUCCESS) {
+            ofLogError("ofxDuktapeWorker") << filename << ": " << heap->safeToString(-1);
+        }
+        heap->pop();
+    }
+}
+
+duk_idx_t ofxDuktapeWorker::pushHandle(ofxDuktape& duk) {
+    if (handle) {
+        handle.push(duk);
+        return duk.normalizeIndex(-1);
+    }
+    duk_idx_t obj = duk.pushObject();
+    duk.putObjectPointer(obj, ofxDuktapeWorkerProp, this);
+    duk.pushFunction([](ofxDuktape& duk) {
+        duk.pushThis();
+        duk.getPropString(-1, ofxDuktapeWorkerProp);
+        ofxDuktapeWorker* worker = (ofxDuktapeWorker*)duk.getPointer(-1);
+        if (!worker) duk._error(DUK_ERR_ERROR, "worker is gone");
+        duk.dup(0);
+        worker->postMessage(duk.cborEncode(-1));
+        return 0;
+    }, 1);
+    duk.putPropString(obj, "postMessage");
+    handle.reset(duk, obj);
+    ofAddListener(duk.onDestroy, this, &ofxDuktapeWorker::onHeapDestroy);
+    lock_guard<mutex> guard(lock);
+    handleHeap = &duk;
+    // messages the worker posted before there was a handle
+    postDelivery();
+    return obj;
+}
+
+void ofxDuktapeWorker::update() {
+    deque<string> messages;
+    {
+        lock_guard<mutex> guard(lock);
+        messages.swap(outbox);
+        deliveryPosted = false;
+    }
+    if (!handle) return;
+    ofxDuktape& duk = *handle.getDuktape();
+    for (const string& message: messages) {
+        int ret = duk.safeCall([this, &message](ofxDuktape& duk) {
+            handle.push(duk);
+            if (!duk.getPropString(-1, "onmessage") || !duk.isFunction(-1)) return 0;
+            duk.swap(-1, -2);
+            duk.cborDecode(message);
+            duk.callMethod(1);
+            return 0;
+        }, 0, 1);
+        if (ret != DUK_EXEC_SUCCESS) {
+            ofLogError("ofxDuktapeWorker") << "onmessage: " << duk.safeToString(-1);
+        }
+        duk.pop();
+    }
+}
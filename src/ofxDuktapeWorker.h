@@ -0,0 +1,127 @@
+//
+//  ofxDuktapeWorker.h
+//  openFrameworks addon for interacting with the Duktape VM
+//
+//  worker heaps run on a pool of background threads and talk to the
+//  main thread through CBOR-encoded messages
+//
+
+#pragma once
+
+#include "ofMain.h"
+#include "ofxDuktape.h"
+
+class ofxDuktapeWorker;
+
+// threads that run worker heaps. a heap is only ever run by one pool thread
+// at a time, so any number of workers can share a few threads
+class ofxDuktapeWorkerPool {
+public:
+    // 0 threads picks one less than the number of cores (at least one)
+    ofxDuktapeWorkerPool(size_t threads = 0);
+    // workers have to be destroyed before their pool
+    virtual ~ofxDuktapeWorkerPool();
+
+    inline size_t getThreadCount() const { return threads.size(); }
+
+    // runs every job on the pool, the calling thread helping out with these
+    // jobs only, and returns once all of them are done. jobs go ahead of
+    // queued workers
+    void run(const vector<function<void()>>& jobs);
+    // queues a job without waiting for it
+    void submit(function<void()> job);
+
+    // pool used by workers constructed without one
+    static ofxDuktapeWorkerPool& getShared();
+
+protected:
+    friend class ofxDuktapeWorker;
+    mutex lock;
+    condition_variable wake;
+    // workers with pending work, each queued at most once
+    deque<ofxDuktapeWorker*> ready;
+    // jobs handed to run(), each counting down the batch it belongs to,
+    // or to submit(), with no batch
+    struct Job {
+        function<void()> fn;
+        size_t* remaining;
+    };
+    deque<Job> jobs;
+    condition_variable jobsDone;
+    vector<thread> threads;
+    bool stopping;
+
+    void schedule(ofxDuktapeWorker* worker);
+    void unschedule(ofxDuktapeWorker* worker);
+    void threadedFunction();
+    // runs a job taken off the queue, with the lock held on entry and exit
+    void runJob(Job& job, unique_lock<mutex>& guard);
+};
+
+// a heap running a script in the background. the script gets a global
+// postMessage(value) and receives messages in a global onmessage(value);
+// on the main thread, the handle from pushHandle() has the same pair
+class ofxDuktapeWorker {
+public:
+    typedef function<void(ofxDuktape&)> setup_function;
+
+    ofxDuktapeWorker(ofxDuktapeWorkerPool& pool = ofxDuktapeWorkerPool::getShared());
+    // waits for the worker to finish what it's running and destroys its heap
+    virtual ~ofxDuktapeWorker();
+
+    // creates the heap and runs the script on the pool. setup (if any) is
+    // called on the new heap beforehand, from the pool thread
+    void start(const string& script, const string& filename = "worker", setup_function setup = nullptr);
+
+    // queues a copy of the value at index (from a main thread heap) for the worker's onmessage
+    void postMessage(ofxDuktape& duk, duk_idx_t index);
+    // queues an already CBOR-encoded message
+    void postMessage(const string& cbor);
+
+    // pushes the script-side handle for this worker: an object with
+    // postMessage(value) and an onmessage(value) property. messages from the
+    // worker are delivered to onmessage at duk's next runPosted(), which
+    // ofxDukBindings runs every update. the handle is let go when duk is destroyed
+    duk_idx_t pushHandle(ofxDuktape& duk);
+    // delivers the messages posted by the worker to the handle's onmessage
+    // right away. call from the thread owning the heap the handle was pushed to
+    void update();
+
+    // messages posted to the worker that it hasn't handled yet
+    size_t getPendingCount();
+
+protected:
+    friend class ofxDuktapeWorkerPool;
+    ofxDuktapeWorkerPool& pool;
+    ofxDuktape* heap;
+    string script;
+    string filename;
+    setup_function setup;
+    bool started;
+
+    mutex lock;
+    condition_variable idle;
+    deque<string> inbox;
+    deque<string> outbox;
+    // queued on the pool or being run by one of its threads
+    bool scheduled;
+    bool running;
+    bool destroying;
+
+    // script-side handle on the main thread, and its heap as seen from the
+    // pool (under lock, NULL once the handle is gone)
+    ofxDukRef handle;
+    ofxDuktape* handleHeap;
+    // whether a call to update() is posted to handleHeap and hasn't run yet
+    bool deliveryPosted;
+    // cleared on destruction, so posted deliveries left behind do nothing
+    shared_ptr<bool> alive;
+    // posts a delivery if needed, with the lock held
+    void postDelivery();
+    void revokeHandle();
+    void onHeapDestroy(ofxDuktape::DestroyEvent& ev);
+
+    // runs pending work, from a pool thread
+    void process();
+    void post(deque<string>& queue, const string& message);
+};